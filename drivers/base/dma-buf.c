@@ -250,6 +250,11 @@ void dma_buf_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
 
 	mutex_lock(&dmabuf->lock);
 	list_del(&attach->node);
+	if (attach->sgt) {
+		WARN_ON(attach->map_count);
+		dmabuf->ops->unmap_dma_buf(attach, attach->sgt, attach->dir);
+		attach->sgt = NULL;
+	}
 	if (dmabuf->ops->detach)
 		dmabuf->ops->detach(dmabuf, attach);
 
@@ -265,6 +270,10 @@ EXPORT_SYMBOL_GPL(dma_buf_detach);
  * @attach:	[in]	attachment whose scatterlist is to be returned
  * @direction:	[in]	direction of DMA transfer
  *
+ * If the exporter set cache_sgt_mapping, the first mapping of an attachment
+ * is kept and returned again by later calls in the same direction, so that
+ * importers mapping the same buffer every frame only pay for it once.
+ *
  * Returns sg_table containing the scatterlist to be returned; may return NULL
  * or ERR_PTR.
  *
@@ -273,13 +282,42 @@ struct sg_table *dma_buf_map_attachment(struct dma_buf_attachment *attach,
 					enum dma_data_direction direction)
 {
 	struct sg_table *sg_table = ERR_PTR(-EINVAL);
+	struct dma_buf *dmabuf;
 
 	might_sleep();
 
 	if (WARN_ON(!attach || !attach->dmabuf))
 		return ERR_PTR(-EINVAL);
 
-	sg_table = attach->dmabuf->ops->map_dma_buf(attach, direction);
+	dmabuf = attach->dmabuf;
+	if (!dmabuf->ops->cache_sgt_mapping)
+		return dmabuf->ops->map_dma_buf(attach, direction);
+
+	mutex_lock(&dmabuf->lock);
+	if (attach->sgt && !attach->sgt_stale && attach->dir == direction) {
+		attach->map_count++;
+		mutex_unlock(&dmabuf->lock);
+		return attach->sgt;
+	}
+
+	/* an idle cached mapping in the wrong direction can simply go */
+	if (attach->sgt && !attach->map_count) {
+		dmabuf->ops->unmap_dma_buf(attach, attach->sgt, attach->dir);
+		attach->sgt = NULL;
+		attach->sgt_stale = false;
+	}
+
+	sg_table = dmabuf->ops->map_dma_buf(attach, direction);
+	/*
+	 * If the old mapping is still held, the new one is handed out
+	 * uncached and goes straight back to the exporter on unmap.
+	 */
+	if (!IS_ERR_OR_NULL(sg_table) && !attach->sgt) {
+		attach->sgt = sg_table;
+		attach->dir = direction;
+		attach->map_count = 1;
+	}
+	mutex_unlock(&dmabuf->lock);
 
 	return sg_table;
 }
@@ -298,14 +336,64 @@ void dma_buf_unmap_attachment(struct dma_buf_attachment *attach,
 				struct sg_table *sg_table,
 				enum dma_data_direction direction)
 {
+	struct dma_buf *dmabuf;
+
 	if (WARN_ON(!attach || !attach->dmabuf || !sg_table))
 		return;
 
-	attach->dmabuf->ops->unmap_dma_buf(attach, sg_table,
-						direction);
+	dmabuf = attach->dmabuf;
+	if (dmabuf->ops->cache_sgt_mapping) {
+		mutex_lock(&dmabuf->lock);
+		if (sg_table == attach->sgt) {
+			WARN_ON(!attach->map_count);
+			if (--attach->map_count || !attach->sgt_stale) {
+				mutex_unlock(&dmabuf->lock);
+				return;
+			}
+			attach->sgt = NULL;
+			attach->sgt_stale = false;
+			direction = attach->dir;
+		}
+		mutex_unlock(&dmabuf->lock);
+	}
+
+	dmabuf->ops->unmap_dma_buf(attach, sg_table, direction);
 }
 EXPORT_SYMBOL_GPL(dma_buf_unmap_attachment);
 
+/**
+ * dma_buf_invalidate_mappings - drop the sg_tables cached on the attachments
+ * of a buffer.
+ * @dmabuf:	[in]	buffer whose backing storage moved or is going away.
+ *
+ * Called by exporters using cache_sgt_mapping whenever the mapping they once
+ * handed out no longer describes the buffer. Idle cached mappings are
+ * unmapped right away; ones still in use are unmapped by the last
+ * dma_buf_unmap_attachment() and never handed out again, so the next
+ * dma_buf_map_attachment() asks the exporter for a fresh one.
+ */
+void dma_buf_invalidate_mappings(struct dma_buf *dmabuf)
+{
+	struct dma_buf_attachment *attach;
+
+	if (WARN_ON(!dmabuf))
+		return;
+
+	mutex_lock(&dmabuf->lock);
+	list_for_each_entry(attach, &dmabuf->attachments, node) {
+		if (!attach->sgt)
+			continue;
+		if (attach->map_count) {
+			attach->sgt_stale = true;
+			continue;
+		}
+		dmabuf->ops->unmap_dma_buf(attach, attach->sgt, attach->dir);
+		attach->sgt = NULL;
+	}
+	mutex_unlock(&dmabuf->lock);
+}
+EXPORT_SYMBOL_GPL(dma_buf_invalidate_mappings);
+
 
 /**
  * dma_buf_begin_cpu_access - Must be called before accessing a dma_buf from the
@@ -36,17 +36,70 @@ static int _sync_pt_has_signaled(struct sync_pt *pt);
 static void sync_fence_free(struct kref *kref);
 static void sync_dump(struct sync_fence *fence);
 
+#ifdef CONFIG_SYNC_DEBUG
 static LIST_HEAD(sync_timeline_list_head);
 static DEFINE_SPINLOCK(sync_timeline_list_lock);
 
 static LIST_HEAD(sync_fence_list_head);
 static DEFINE_SPINLOCK(sync_fence_list_lock);
 
+static void sync_timeline_debug_add(struct sync_timeline *obj)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_timeline_list_lock, flags);
+	list_add_tail(&obj->sync_timeline_list, &sync_timeline_list_head);
+	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+}
+
+static void sync_timeline_debug_remove(struct sync_timeline *obj)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_timeline_list_lock, flags);
+	list_del(&obj->sync_timeline_list);
+	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+}
+
+static void sync_fence_debug_add(struct sync_fence *fence)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_fence_list_lock, flags);
+	list_add_tail(&fence->sync_fence_list, &sync_fence_list_head);
+	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+}
+
+static void sync_fence_debug_remove(struct sync_fence *fence)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sync_fence_list_lock, flags);
+	list_del(&fence->sync_fence_list);
+	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+}
+#else
+static inline void sync_timeline_debug_add(struct sync_timeline *obj)
+{
+}
+
+static inline void sync_timeline_debug_remove(struct sync_timeline *obj)
+{
+}
+
+static inline void sync_fence_debug_add(struct sync_fence *fence)
+{
+}
+
+static inline void sync_fence_debug_remove(struct sync_fence *fence)
+{
+}
+#endif
+
 struct sync_timeline *sync_timeline_create(const struct sync_timeline_ops *ops,
 					   int size, const char *name)
 {
 	struct sync_timeline *obj;
-	unsigned long flags;
 
 	if (size < sizeof(struct sync_timeline))
 		return NULL;
@@ -65,9 +118,7 @@ struct sync_timeline *sync_timeline_create(const struct sync_timeline_ops *ops,
 	INIT_LIST_HEAD(&obj->active_list_head);
 	spin_lock_init(&obj->active_list_lock);
 
-	spin_lock_irqsave(&sync_timeline_list_lock, flags);
-	list_add_tail(&obj->sync_timeline_list, &sync_timeline_list_head);
-	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+	sync_timeline_debug_add(obj);
 
 	return obj;
 }
@@ -77,11 +128,8 @@ static void sync_timeline_free(struct kref *kref)
 {
 	struct sync_timeline *obj =
 		container_of(kref, struct sync_timeline, kref);
-	unsigned long flags;
 
-	spin_lock_irqsave(&sync_timeline_list_lock, flags);
-	list_del(&obj->sync_timeline_list);
-	spin_unlock_irqrestore(&sync_timeline_list_lock, flags);
+	sync_timeline_debug_remove(obj);
 
 	if (obj->ops->release_obj)
 		obj->ops->release_obj(obj);
@@ -253,7 +301,6 @@ static const struct file_operations sync_fence_fops = {
 static struct sync_fence *sync_fence_alloc(const char *name)
 {
 	struct sync_fence *fence;
-	unsigned long flags;
 
 	fence = kzalloc(sizeof(struct sync_fence), GFP_KERNEL);
 	if (fence == NULL)
@@ -273,9 +320,7 @@ static struct sync_fence *sync_fence_alloc(const char *name)
 
 	init_waitqueue_head(&fence->wq);
 
-	spin_lock_irqsave(&sync_fence_list_lock, flags);
-	list_add_tail(&fence->sync_fence_list, &sync_fence_list_head);
-	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+	sync_fence_debug_add(fence);
 
 	return fence;
 
@@ -310,67 +355,55 @@ struct sync_fence *sync_fence_create(const char *name, struct sync_pt *pt)
 }
 EXPORT_SYMBOL(sync_fence_create);
 
-static int sync_fence_copy_pts(struct sync_fence *dst, struct sync_fence *src)
+static struct sync_pt *sync_fence_next_pt(struct sync_fence *fence,
+					   struct list_head *pos)
 {
-	struct list_head *pos;
-
-	list_for_each(pos, &src->pt_list_head) {
-		struct sync_pt *orig_pt =
-			container_of(pos, struct sync_pt, pt_list);
-		struct sync_pt *new_pt = sync_pt_dup(orig_pt);
+	if (pos == &fence->pt_list_head)
+		return NULL;
+	return container_of(pos, struct sync_pt, pt_list);
+}
 
-		if (new_pt == NULL)
-			return -ENOMEM;
+/*
+ * Both point lists are sorted by timeline, so they are merged in one
+ * pass.  Two sync_pts on the same timeline collapse to a single sync_pt
+ * that will signal at the later of the two.
+ */
+static int sync_fence_merge_pts(struct sync_fence *dst,
+				struct sync_fence *a, struct sync_fence *b)
+{
+	struct list_head *pos_a = a->pt_list_head.next;
+	struct list_head *pos_b = b->pt_list_head.next;
 
-		new_pt->fence = dst;
-		list_add(&new_pt->pt_list, &dst->pt_list_head);
-	}
+	while (true) {
+		struct sync_pt *pt_a = sync_fence_next_pt(a, pos_a);
+		struct sync_pt *pt_b = sync_fence_next_pt(b, pos_b);
+		struct sync_pt *src_pt;
+		struct sync_pt *new_pt;
 
-	return 0;
-}
+		if (!pt_a && !pt_b)
+			break;
 
-static int sync_fence_merge_pts(struct sync_fence *dst, struct sync_fence *src)
-{
-	struct list_head *src_pos, *dst_pos, *n;
-
-	list_for_each(src_pos, &src->pt_list_head) {
-		struct sync_pt *src_pt =
-			container_of(src_pos, struct sync_pt, pt_list);
-		bool collapsed = false;
-
-		list_for_each_safe(dst_pos, n, &dst->pt_list_head) {
-			struct sync_pt *dst_pt =
-				container_of(dst_pos, struct sync_pt, pt_list);
-			/* collapse two sync_pts on the same timeline
-			 * to a single sync_pt that will signal at
-			 * the later of the two
-			 */
-			if (dst_pt->parent == src_pt->parent) {
-				if (dst_pt->parent->ops->compare(dst_pt, src_pt) == -1) {
-					struct sync_pt *new_pt =
-						sync_pt_dup(src_pt);
-					if (new_pt == NULL)
-						return -ENOMEM;
-
-					new_pt->fence = dst;
-					list_replace(&dst_pt->pt_list,
-						     &new_pt->pt_list);
-					sync_pt_free(dst_pt);
-				}
-				collapsed = true;
-				break;
-			}
+		if (!pt_b || (pt_a && pt_a->parent < pt_b->parent)) {
+			src_pt = pt_a;
+			pos_a = pos_a->next;
+		} else if (!pt_a || pt_b->parent < pt_a->parent) {
+			src_pt = pt_b;
+			pos_b = pos_b->next;
+		} else {
+			if (pt_a->parent->ops->compare(pt_a, pt_b) == -1)
+				src_pt = pt_b;
+			else
+				src_pt = pt_a;
+			pos_a = pos_a->next;
+			pos_b = pos_b->next;
 		}
 
-		if (!collapsed) {
-			struct sync_pt *new_pt = sync_pt_dup(src_pt);
-
-			if (new_pt == NULL)
-				return -ENOMEM;
+		new_pt = sync_pt_dup(src_pt);
+		if (new_pt == NULL)
+			return -ENOMEM;
 
-			new_pt->fence = dst;
-			list_add(&new_pt->pt_list, &dst->pt_list_head);
-		}
+		new_pt->fence = dst;
+		list_add_tail(&new_pt->pt_list, &dst->pt_list_head);
 	}
 
 	return 0;
@@ -457,11 +490,7 @@ struct sync_fence *sync_fence_merge(const char *name,
 	if (fence == NULL)
 		return NULL;
 
-	err = sync_fence_copy_pts(fence, a);
-	if (err < 0)
-		goto err;
-
-	err = sync_fence_merge_pts(fence, b);
+	err = sync_fence_merge_pts(fence, a, b);
 	if (err < 0)
 		goto err;
 
@@ -640,7 +669,6 @@ static void sync_fence_free(struct kref *kref)
 static int sync_fence_release(struct inode *inode, struct file *file)
 {
 	struct sync_fence *fence = file->private_data;
-	unsigned long flags;
 
 	/*
 	 * We need to remove all ways to access this fence before droping
@@ -648,9 +676,7 @@ static int sync_fence_release(struct inode *inode, struct file *file)
 	 *
 	 * start with its membership in the global fence list
 	 */
-	spin_lock_irqsave(&sync_fence_list_lock, flags);
-	list_del(&fence->sync_fence_list);
-	spin_unlock_irqrestore(&sync_fence_list_lock, flags);
+	sync_fence_debug_remove(fence);
 
 	/*
 	 * remove its pts from their parents so that sync_timeline_signal()
@@ -881,6 +907,7 @@ static void sync_print_pt(struct seq_file *s, struct sync_pt *pt, bool fence)
 	seq_printf(s, "\n");
 }
 
+#ifdef CONFIG_SYNC_DEBUG
 static void sync_print_obj(struct seq_file *s, struct sync_timeline *obj)
 {
 	struct list_head *pos;
@@ -907,6 +934,7 @@ static void sync_print_obj(struct seq_file *s, struct sync_timeline *obj)
 	}
 	spin_unlock_irqrestore(&obj->child_list_lock, flags);
 }
+#endif
 
 static void sync_print_fence(struct seq_file *s, struct sync_fence *fence)
 {
@@ -933,6 +961,7 @@ static void sync_print_fence(struct seq_file *s, struct sync_fence *fence)
 	spin_unlock_irqrestore(&fence->waiter_list_lock, flags);
 }
 
+#ifdef CONFIG_SYNC_DEBUG
 static int sync_debugfs_show(struct seq_file *s, void *unused)
 {
 	unsigned long flags;
@@ -983,6 +1012,7 @@ static __init int sync_debugfs_init(void)
 	return 0;
 }
 late_initcall(sync_debugfs_init);
+#endif
 
 #define DUMP_CHUNK 256
 static char sync_dump_buf[64 * 1024];
@@ -13,12 +13,16 @@
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
+#include <linux/percpu.h>
 
 #include "zcomp.h"
 #include "zcomp_lzo.h"
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 #include "zcomp_lz4.h"
 #endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+#include "zcomp_lz4hc.h"
+#endif
 
 /*
  * single zcomp_strm backend
@@ -43,10 +47,20 @@ struct zcomp_strm_multi {
 	wait_queue_head_t strm_wait;
 };
 
+/*
+ * per-cpu zcomp_strm backend
+ */
+struct zcomp_strm_percpu {
+	struct zcomp_strm * __percpu *zstrm;
+};
+
 static struct zcomp_backend *backends[] = {
 	&zcomp_lzo,
 #ifdef CONFIG_ZRAM_LZ4_COMPRESS
 	&zcomp_lz4,
+#endif
+#ifdef CONFIG_ZRAM_LZ4HC_COMPRESS
+	&zcomp_lz4hc,
 #endif
 	NULL
 };
@@ -267,6 +281,81 @@ static int zcomp_strm_single_create(struct zcomp *comp)
 	return 0;
 }
 
+/*
+ * return this CPU's stream. Preemption stays disabled until
+ * zcomp_strm_percpu_release(), so there is no list to lock and
+ * nobody to wait for.
+ */
+static struct zcomp_strm *zcomp_strm_percpu_find(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+
+	return *get_cpu_ptr(zs->zstrm);
+}
+
+static void zcomp_strm_percpu_release(struct zcomp *comp,
+		struct zcomp_strm *zstrm)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+
+	put_cpu_ptr(zs->zstrm);
+}
+
+static bool zcomp_strm_percpu_set_max_streams(struct zcomp *comp,
+		int num_strm)
+{
+	/* the number of streams is fixed to the number of CPUs */
+	return false;
+}
+
+static void zcomp_strm_percpu_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs = comp->stream;
+	struct zcomp_strm *zstrm;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		zstrm = *per_cpu_ptr(zs->zstrm, cpu);
+		if (zstrm)
+			zcomp_strm_free(comp, zstrm);
+	}
+	free_percpu(zs->zstrm);
+	kfree(zs);
+}
+
+static int zcomp_strm_percpu_create(struct zcomp *comp)
+{
+	struct zcomp_strm_percpu *zs;
+	int cpu;
+
+	comp->destroy = zcomp_strm_percpu_destroy;
+	comp->strm_find = zcomp_strm_percpu_find;
+	comp->strm_release = zcomp_strm_percpu_release;
+	comp->set_max_streams = zcomp_strm_percpu_set_max_streams;
+	zs = kmalloc(sizeof(struct zcomp_strm_percpu), GFP_KERNEL);
+	if (!zs)
+		return -ENOMEM;
+
+	zs->zstrm = alloc_percpu(struct zcomp_strm *);
+	if (!zs->zstrm) {
+		kfree(zs);
+		return -ENOMEM;
+	}
+
+	comp->stream = zs;
+	for_each_possible_cpu(cpu) {
+		struct zcomp_strm *zstrm = zcomp_strm_alloc(comp);
+
+		if (!zstrm) {
+			zcomp_strm_percpu_destroy(comp);
+			comp->stream = NULL;
+			return -ENOMEM;
+		}
+		*per_cpu_ptr(zs->zstrm, cpu) = zstrm;
+	}
+	return 0;
+}
+
 /* show available compressors */
 ssize_t zcomp_available_show(const char *comp, char *buf)
 {
@@ -341,7 +430,9 @@ struct zcomp *zcomp_create(const char *compress, int max_strm)
 		return ERR_PTR(-ENOMEM);
 
 	comp->backend = backend;
-	if (max_strm > 1)
+	if (max_strm == ZCOMP_PERCPU_STREAMS)
+		zcomp_strm_percpu_create(comp);
+	else if (max_strm > 1)
 		zcomp_strm_multi_create(comp, max_strm);
 	else
 		zcomp_strm_single_create(comp);
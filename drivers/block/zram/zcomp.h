@@ -12,6 +12,13 @@
 
 #include <linux/mutex.h>
 
+/*
+ * max_strm value selecting the per-cpu backend: one stream per CPU,
+ * used with preemption disabled between zcomp_strm_find() and
+ * zcomp_strm_release(), so callers must not sleep in between.
+ */
+#define ZCOMP_PERCPU_STREAMS	(-1)
+
 struct zcomp_strm {
 	/* compression/decompression buffer */
 	void *buffer;
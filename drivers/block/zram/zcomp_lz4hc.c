@@ -0,0 +1,46 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
+
+#include "zcomp_lz4hc.h"
+
+static void *zcomp_lz4hc_create(void)
+{
+	/* LZ4HC_MEM_COMPRESS is too large for kmalloc */
+	return vzalloc(LZ4HC_MEM_COMPRESS);
+}
+
+static void zcomp_lz4hc_destroy(void *private)
+{
+	vfree(private);
+}
+
+static int zcomp_lz4hc_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	/* return  : Success if return 0 */
+	return lz4hc_compress(src, PAGE_SIZE, dst, dst_len, private);
+}
+
+static int zcomp_lz4hc_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+	/* return  : Success if return 0 */
+	return lz4_decompress_unknownoutputsize(src, src_len, dst, &dst_len);
+}
+
+struct zcomp_backend zcomp_lz4hc = {
+	.compress = zcomp_lz4hc_compress,
+	.decompress = zcomp_lz4hc_decompress,
+	.create = zcomp_lz4hc_create,
+	.destroy = zcomp_lz4hc_destroy,
+	.name = "lz4hc",
+};
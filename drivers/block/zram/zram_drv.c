@@ -23,15 +23,19 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 #include <linux/err.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -190,6 +194,44 @@ static ssize_t mem_used_max_store(struct device *dev,
 	return len;
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	zs_compact(meta->mem_pool);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 val = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (init_done(zram)) {
+		struct zram_meta *meta = zram->meta;
+		struct zs_pool_stats pool_stats;
+
+		zs_pool_stats(meta->mem_pool, &pool_stats);
+		val = atomic_long_read(&pool_stats.pages_compacted);
+	}
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", val);
+}
+
 static ssize_t max_comp_streams_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
@@ -219,6 +261,39 @@ out:
 	return ret;
 }
 
+static ssize_t percpu_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->percpu_comp_streams;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+static ssize_t percpu_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change stream backend for initialized device\n");
+		return -EBUSY;
+	}
+	zram->percpu_comp_streams = val;
+	up_write(&zram->init_lock);
+	return len;
+}
+
 static ssize_t comp_algorithm_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -247,23 +322,115 @@ static ssize_t comp_algorithm_store(struct device *dev,
 	return len;
 }
 
-/* flag operations needs meta->tb_lock */
+static ssize_t recomp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	sz = zcomp_available_show(zram->recomp_compressor, buf);
+	up_read(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t recomp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	if (sysfs_streq(buf, "none"))
+		zram->recomp_compressor[0] = '\0';
+	else
+		strlcpy(zram->recomp_compressor, buf,
+			sizeof(zram->recomp_compressor));
+	up_write(&zram->init_lock);
+	return len;
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->use_dedup;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change dedup usage for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = val;
+	up_write(&zram->init_lock);
+	return len;
+}
+
+/*
+ * Each table entry is protected by its own ZRAM_ACCESS bit spinlock so
+ * that I/O to different slots does not serialize on a single lock.
+ */
+static inline void zram_slot_lock(struct zram_meta *meta, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+static inline void zram_slot_unlock(struct zram_meta *meta, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+/* flag operations require table entry bit_spin_lock() being held */
 static int zram_test_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	return meta->table[index].flags & BIT(flag);
+	return meta->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	meta->table[index].flags |= BIT(flag);
+	meta->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	meta->table[index].flags &= ~BIT(flag);
+	meta->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram_meta *meta, u32 index)
+{
+	return meta->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
+}
+
+static void zram_set_obj_size(struct zram_meta *meta,
+					u32 index, size_t size)
+{
+	unsigned long flags = meta->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	meta->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
 static inline int is_partial_io(struct bio_vec *bvec)
@@ -295,6 +462,476 @@ static inline int valid_io_request(struct zram *zram,
 	return 1;
 }
 
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index;
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		zram_slot_lock(meta, index);
+		if (meta->table[index].handle &&
+				!zram_test_flag(meta, index, ZRAM_WB))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		zram_slot_unlock(meta, index);
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void reset_bdev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	/* hope filp_close flushes all of the I/O */
+	set_blocksize(zram->bdev, zram->old_block_size);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	zram->backing_dev = NULL;
+	zram->old_block_size = 0;
+	zram->bdev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *file;
+	ssize_t ret;
+	char *p;
+
+	down_read(&zram->init_lock);
+	file = zram->backing_dev;
+	if (!file) {
+		up_read(&zram->init_lock);
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	}
+
+	p = d_path(&file->f_path, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+		goto out;
+	}
+
+	ret = strlen(p);
+	memmove(buf, p, ret);
+	buf[ret++] = '\n';
+out:
+	up_read(&zram->init_lock);
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *backing_dev = NULL;
+	struct block_device *bdev = NULL;
+	struct inode *inode;
+	unsigned long nr_pages, *bitmap = NULL;
+	unsigned int old_block_size;
+	char *file_name;
+	size_t sz;
+	int err;
+
+	file_name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Can't setup backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	strlcpy(file_name, buf, PATH_MAX);
+	/* ignore trailing newline */
+	sz = strlen(file_name);
+	if (sz > 0 && file_name[sz - 1] == '\n')
+		file_name[sz - 1] = 0x00;
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		err = PTR_ERR(backing_dev);
+		backing_dev = NULL;
+		goto out;
+	}
+
+	inode = backing_dev->f_mapping->host;
+	/* Only block devices are supported as backing storage */
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out;
+
+	reset_bdev(zram);
+
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	up_write(&zram->init_lock);
+
+	pr_info("setup backing device %s\n", file_name);
+	kfree(file_name);
+
+	return len;
+out:
+	vfree(bitmap);
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	if (backing_dev)
+		filp_close(backing_dev, NULL);
+	up_write(&zram->init_lock);
+	kfree(file_name);
+
+	return err;
+}
+
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+retry:
+	/* skip 0 bit to not confuse it with an empty zram handle */
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx >= zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	int was_set;
+
+	was_set = test_and_clear_bit(blk_idx, zram->bitmap);
+	WARN_ON_ONCE(!was_set);
+	atomic64_dec(&zram->stats.bd_count);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronously transfer one page from/to the backing device */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long blk_idx, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_work {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long blk_idx;
+	struct page *page;
+	int error;
+};
+
+static void zram_sync_read(struct work_struct *work)
+{
+	struct zram_work *zw = container_of(work, struct zram_work, work);
+
+	zw->error = zram_bdev_rw(zw->zram, zw->page, zw->blk_idx, READ);
+}
+
+/*
+ * generic_make_request() defers bios submitted from within a
+ * make_request_fn until it returns, so waiting for our own bio from
+ * zram's request context would deadlock. Do the read from a worker.
+ */
+static int read_from_bdev(struct zram *zram, struct page *page,
+			unsigned long blk_idx)
+{
+	struct zram_work work;
+
+	work.zram = zram;
+	work.page = page;
+	work.blk_idx = blk_idx;
+
+	INIT_WORK_ONSTACK(&work.work, zram_sync_read);
+	queue_work(system_unbound_wq, &work.work);
+	flush_work(&work.work);
+	destroy_work_on_stack(&work.work);
+
+	atomic64_inc(&zram->stats.bd_reads);
+	return work.error;
+}
+#else
+static inline void reset_bdev(struct zram *zram) { }
+static inline int read_from_bdev(struct zram *zram, struct page *page,
+			unsigned long blk_idx)
+{
+	return -EIO;
+}
+
+static inline void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+}
+#endif
+
+static inline bool zram_dedup_enabled(struct zram_meta *meta)
+{
+	return meta->hash != NULL;
+}
+
+static inline struct zram_hash *zram_dedup_hash(struct zram_meta *meta,
+						u32 checksum)
+{
+	return &meta->hash[checksum % meta->hash_size];
+}
+
+static u32 zram_dedup_checksum(unsigned char *mem)
+{
+	return jhash2((u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static void zram_dedup_insert(struct zram_meta *meta, struct zram_entry *new,
+				u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(meta, checksum);
+	struct rb_node **rb_node, *parent = NULL;
+	struct zram_entry *entry;
+
+	new->checksum = checksum;
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		entry = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < entry->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+
+	rb_link_node(&new->rb_node, parent, rb_node);
+	rb_insert_color(&new->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+}
+
+/*
+ * Drop a reference to a shared object, either a table entry's or, if
+ * @pin, one taken by zram_dedup_find(). The sizes in @stats follow the
+ * references under the hash lock: a table reference counts as a
+ * duplicate while other table entries share the object, and the
+ * compressed size goes once the object is freed. @stats is NULL when
+ * the whole device is being torn down.
+ */
+static void zram_dedup_put(struct zram_meta *meta, struct zram_stats *stats,
+			struct zram_entry *entry, bool pin)
+{
+	struct zram_hash *hash = zram_dedup_hash(meta, entry->checksum);
+	bool last;
+
+	spin_lock(&hash->lock);
+	if (pin)
+		entry->pins--;
+	else if (stats && entry->refcount - entry->pins > 1)
+		atomic64_sub(entry->len, &stats->dup_data_size);
+	last = !--entry->refcount;
+	if (last) {
+		if (stats)
+			atomic64_sub(entry->len, &stats->compr_data_size);
+		/* recompressed objects are never shared and not in the tree */
+		if (!RB_EMPTY_NODE(&entry->rb_node))
+			rb_erase(&entry->rb_node, &hash->rb_root);
+	}
+	spin_unlock(&hash->lock);
+
+	if (last) {
+		zs_free(meta->mem_pool, entry->handle);
+		kfree(entry);
+	}
+}
+
+static bool zram_dedup_match(struct zram *zram, struct zcomp_strm *zstrm,
+			struct zram_entry *entry, unsigned char *mem)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned char *cmem;
+	bool match;
+
+	cmem = zs_map_object(meta->mem_pool, entry->handle, ZS_MM_RO);
+	if (entry->len == PAGE_SIZE)
+		match = !memcmp(mem, cmem, PAGE_SIZE);
+	else
+		match = !zcomp_decompress(zram->comp, cmem, entry->len,
+					zstrm->buffer) &&
+			!memcmp(mem, zstrm->buffer, PAGE_SIZE);
+	zs_unmap_object(meta->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look for a stored object with the same content as @mem. On success
+ * a reference to the object is taken and it is returned. zstrm->buffer
+ * is used as scratch space for decompressing the candidates.
+ */
+static struct zram_entry *zram_dedup_find(struct zram *zram,
+			struct zcomp_strm *zstrm, unsigned char *mem,
+			u32 checksum)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_hash *hash = zram_dedup_hash(meta, checksum);
+	struct zram_entry *entry = NULL, *next;
+	struct rb_node *rb_node;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum)
+			break;
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+
+	if (!rb_node) {
+		spin_unlock(&hash->lock);
+		return NULL;
+	}
+
+	/* find left-most entry with same checksum */
+	while ((rb_node = rb_prev(&entry->rb_node))) {
+		next = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (next->checksum != checksum)
+			break;
+		entry = next;
+	}
+
+	/* Pin the candidate so it can be compared without the hash lock */
+	entry->refcount++;
+	entry->pins++;
+	spin_unlock(&hash->lock);
+
+	while (entry) {
+		if (zram_dedup_match(zram, zstrm, entry, mem)) {
+			/* the pin becomes the caller's table reference */
+			spin_lock(&hash->lock);
+			entry->pins--;
+			if (entry->refcount - entry->pins > 1)
+				atomic64_add(entry->len,
+					&zram->stats.dup_data_size);
+			spin_unlock(&hash->lock);
+			return entry;
+		}
+
+		spin_lock(&hash->lock);
+		next = NULL;
+		rb_node = rb_next(&entry->rb_node);
+		if (rb_node) {
+			next = rb_entry(rb_node, struct zram_entry, rb_node);
+			if (next->checksum == checksum) {
+				next->refcount++;
+				next->pins++;
+			} else
+				next = NULL;
+		}
+		spin_unlock(&hash->lock);
+
+		zram_dedup_put(meta, &zram->stats, entry, true);
+		entry = next;
+	}
+
+	return NULL;
+}
+
+/*
+ * Release the object referenced by table entry @index and account for
+ * it in @stats, which is NULL when the whole device is being torn down.
+ */
+static void zram_put_object(struct zram_meta *meta, struct zram_stats *stats,
+			u32 index)
+{
+	if (zram_dedup_enabled(meta)) {
+		zram_dedup_put(meta, stats, meta->table[index].entry, false);
+		return;
+	}
+
+	zs_free(meta->mem_pool, meta->table[index].handle);
+	if (stats)
+		atomic64_sub(zram_get_obj_size(meta, index),
+				&stats->compr_data_size);
+}
+
+static inline unsigned long zram_entry_handle(struct zram_meta *meta,
+						u32 index)
+{
+	if (zram_dedup_enabled(meta))
+		return meta->table[index].entry->handle;
+	return meta->table[index].handle;
+}
+
 static void zram_meta_free(struct zram_meta *meta, u64 disksize)
 {
 	size_t num_pages = disksize >> PAGE_SHIFT;
@@ -302,20 +939,21 @@ static void zram_meta_free(struct zram_meta *meta, u64 disksize)
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < num_pages; index++) {
-		unsigned long handle = meta->table[index].handle;
-
-		if (!handle)
+		/* Backing device blocks go away with the bitmap */
+		if (!meta->table[index].handle ||
+				zram_test_flag(meta, index, ZRAM_WB))
 			continue;
 
-		zs_free(meta->mem_pool, handle);
+		zram_put_object(meta, NULL, index);
 	}
 
 	zs_destroy_pool(meta->mem_pool);
+	vfree(meta->hash);
 	vfree(meta->table);
 	kfree(meta);
 }
 
-static struct zram_meta *zram_meta_alloc(u64 disksize)
+static struct zram_meta *zram_meta_alloc(u64 disksize, bool use_dedup)
 {
 	size_t num_pages;
 	struct zram_meta *meta = kmalloc(sizeof(*meta), GFP_KERNEL);
@@ -329,15 +967,32 @@ static struct zram_meta *zram_meta_alloc(u64 disksize)
 		goto free_meta;
 	}
 
-	meta->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
+	meta->mem_pool = zs_create_pool();
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		goto free_table;
 	}
 
-	rwlock_init(&meta->tb_lock);
+	meta->hash = NULL;
+	if (use_dedup) {
+		size_t i;
+
+		meta->hash_size = max_t(size_t, num_pages >> ZRAM_HASH_SHIFT, 1);
+		meta->hash = vzalloc(meta->hash_size * sizeof(*meta->hash));
+		if (!meta->hash) {
+			pr_err("Error allocating zram dedup hash\n");
+			goto free_pool;
+		}
+		for (i = 0; i < meta->hash_size; i++) {
+			spin_lock_init(&meta->hash[i].lock);
+			meta->hash[i].rb_root = RB_ROOT;
+		}
+	}
+
 	return meta;
 
+free_pool:
+	zs_destroy_pool(meta->mem_pool);
 free_table:
 	vfree(meta->table);
 free_meta:
@@ -384,13 +1039,36 @@ static void handle_zero_page(struct bio_vec *bvec)
 	flush_dcache_page(page);
 }
 
-/* NOTE: caller should hold meta->tb_lock with write-side */
+/*
+ * To protect concurrent access to the same index entry,
+ * caller should hold this table index entry's bit_spinlock to
+ * indicate this index entry is accessing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	struct zram_meta *meta = zram->meta;
-	unsigned long handle = meta->table[index].handle;
 
-	if (unlikely(!handle)) {
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+
+	if (zram_test_flag(meta, index, ZRAM_RECOMP)) {
+		zram_clear_flag(meta, index, ZRAM_RECOMP);
+		atomic64_dec(&zram->stats.recomp_pages);
+		atomic64_sub(zram_get_obj_size(meta, index),
+				&zram->stats.recomp_data_size);
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_block_bdev(zram, meta->table[index].handle);
+		atomic64_dec(&zram->stats.pages_stored);
+		meta->table[index].handle = 0;
+		return;
+	}
+
+	if (unlikely(!meta->table[index].handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -402,40 +1080,52 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
-	zs_free(meta->mem_pool, handle);
-
-	atomic64_sub(meta->table[index].size, &zram->stats.compr_data_size);
+	zram_put_object(meta, &zram->stats, index);
 	atomic64_dec(&zram->stats.pages_stored);
 
 	meta->table[index].handle = 0;
-	meta->table[index].size = 0;
+	zram_set_obj_size(meta, index, 0);
 }
 
-static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+static int zram_decompress_page(struct zram *zram, struct page *page, u32 index)
 {
 	int ret = 0;
-	unsigned char *cmem;
+	unsigned char *cmem, *mem;
 	struct zram_meta *meta = zram->meta;
+	struct zcomp *comp = zram->comp;
 	unsigned long handle;
-	u16 size;
-
-	read_lock(&meta->tb_lock);
-	handle = meta->table[index].handle;
-	size = meta->table[index].size;
+	size_t size;
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
-		read_unlock(&meta->tb_lock);
+	zram_slot_lock(meta, index);
+	if (!meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_ZERO)) {
+		zram_slot_unlock(meta, index);
+		mem = kmap_atomic(page);
 		clear_page(mem);
+		kunmap_atomic(mem);
 		return 0;
 	}
 
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		handle = meta->table[index].handle;
+		zram_slot_unlock(meta, index);
+		return read_from_bdev(zram, page, handle);
+	}
+
+	handle = zram_entry_handle(meta, index);
+	size = zram_get_obj_size(meta, index);
+	if (zram_test_flag(meta, index, ZRAM_RECOMP))
+		comp = zram->recomp;
+
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
+	mem = kmap_atomic(page);
 	if (size == PAGE_SIZE)
 		copy_page(mem, cmem);
 	else
-		ret = zcomp_decompress(zram->comp, cmem, size, mem);
+		ret = zcomp_decompress(comp, cmem, size, mem);
+	kunmap_atomic(mem);
 	zs_unmap_object(meta->mem_pool, handle);
-	read_unlock(&meta->tb_lock);
+	zram_slot_unlock(meta, index);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -451,48 +1141,47 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 {
 	int ret;
 	struct page *page;
-	unsigned char *user_mem, *uncmem = NULL;
+	unsigned char *user_mem, *uncmem;
 	struct zram_meta *meta = zram->meta;
 	page = bvec->bv_page;
 
-	read_lock(&meta->tb_lock);
+	zram_slot_lock(meta, index);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
 	if (unlikely(!meta->table[index].handle) ||
 			zram_test_flag(meta, index, ZRAM_ZERO)) {
-		read_unlock(&meta->tb_lock);
+		zram_slot_unlock(meta, index);
 		handle_zero_page(bvec);
 		return 0;
 	}
-	read_unlock(&meta->tb_lock);
-
-	if (is_partial_io(bvec))
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+	zram_slot_unlock(meta, index);
 
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-
-	if (!uncmem) {
-		pr_info("Unable to allocate temp memory\n");
-		ret = -ENOMEM;
-		goto out_cleanup;
+	if (is_partial_io(bvec)) {
+		/* Use a temporary page to decompress the page */
+		page = alloc_page(GFP_NOIO);
+		if (!page) {
+			pr_info("Unable to allocate temp memory\n");
+			return -ENOMEM;
+		}
 	}
 
-	ret = zram_decompress_page(zram, uncmem, index);
+	ret = zram_decompress_page(zram, page, index);
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret))
 		goto out_cleanup;
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		uncmem = page_address(page);
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 				bvec->bv_len);
+		kunmap_atomic(user_mem);
+	}
 
-	flush_dcache_page(page);
+	flush_dcache_page(bvec->bv_page);
 	ret = 0;
 out_cleanup:
-	kunmap_atomic(user_mem);
 	if (is_partial_io(bvec))
-		kfree(uncmem);
+		__free_page(page);
 	return ret;
 }
 
@@ -515,14 +1204,17 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret = 0;
-	size_t clen;
-	unsigned long handle;
+	size_t clen, alloced_clen = 0;
+	unsigned long handle = 0;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
 	struct zcomp_strm *zstrm;
+	struct zram_entry *entry = NULL, *new_entry = NULL;
+	struct page *tmp_page = NULL;
 	bool locked = false;
 	unsigned long alloced_pages;
+	u32 checksum = 0;
 
 	page = bvec->bv_page;
 	if (is_partial_io(bvec)) {
@@ -530,16 +1222,27 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
-		if (!uncmem) {
+		tmp_page = alloc_page(GFP_NOIO);
+		if (!tmp_page) {
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_decompress_page(zram, uncmem, index);
+		ret = zram_decompress_page(zram, tmp_page, index);
 		if (ret)
 			goto out;
+		uncmem = page_address(tmp_page);
 	}
 
+	/* The stream may not be held across a sleeping allocation */
+	if (zram_dedup_enabled(meta)) {
+		new_entry = kmalloc(sizeof(*new_entry), GFP_NOIO);
+		if (!new_entry) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+compress_again:
 	zstrm = zcomp_strm_find(zram->comp);
 	locked = true;
 	user_mem = kmap_atomic(page);
@@ -556,16 +1259,31 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	if (page_zero_filled(uncmem)) {
 		kunmap_atomic(user_mem);
 		/* Free memory associated with this sector now. */
-		write_lock(&zram->meta->tb_lock);
+		zram_slot_lock(meta, index);
 		zram_free_page(zram, index);
 		zram_set_flag(meta, index, ZRAM_ZERO);
-		write_unlock(&zram->meta->tb_lock);
+		zram_slot_unlock(meta, index);
 
 		atomic64_inc(&zram->stats.zero_pages);
 		ret = 0;
 		goto out;
 	}
 
+	if (zram_dedup_enabled(meta)) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, zstrm, uncmem, checksum);
+		if (entry) {
+			if (!is_partial_io(bvec))
+				kunmap_atomic(user_mem);
+			if (handle) {
+				zs_free(meta->mem_pool, handle);
+				handle = 0;
+			}
+			clen = entry->len;
+			goto found_dup;
+		}
+	}
+
 	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 	if (!is_partial_io(bvec)) {
 		kunmap_atomic(user_mem);
@@ -584,8 +1302,32 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			src = uncmem;
 	}
 
-	handle = zs_malloc(meta->mem_pool, clen);
+	/* The content changed since the slow path allocation below */
+	if (handle && clen != alloced_clen) {
+		zs_free(meta->mem_pool, handle);
+		handle = 0;
+	}
+
+	/*
+	 * The handle is first allocated without sleeping, since the
+	 * per-cpu compression stream keeps preemption disabled. If that
+	 * fails, release the stream, allocate with reclaim allowed and
+	 * compress the page again.
+	 */
+	if (!handle)
+		handle = zs_malloc(meta->mem_pool, clen,
+				GFP_NOWAIT | __GFP_NOWARN | __GFP_HIGHMEM);
 	if (!handle) {
+		zcomp_strm_release(zram->comp, zstrm);
+		locked = false;
+
+		handle = zs_malloc(meta->mem_pool, clen,
+				GFP_NOIO | __GFP_HIGHMEM);
+		if (handle) {
+			alloced_clen = clen;
+			goto compress_again;
+		}
+
 		pr_info("Error allocating memory for compressed page: %u, size=%zu\n",
 			index, clen);
 		ret = -ENOMEM;
@@ -595,12 +1337,22 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	alloced_pages = zs_get_total_pages(meta->mem_pool);
 	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
 		zs_free(meta->mem_pool, handle);
+		handle = 0;
 		ret = -ENOMEM;
 		goto out;
 	}
 
 	update_used_max(zram, alloced_pages);
 
+	if (new_entry) {
+		entry = new_entry;
+		new_entry = NULL;
+		entry->handle = handle;
+		entry->len = clen;
+		entry->refcount = 1;
+		entry->pins = 0;
+	}
+
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
 
 	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
@@ -615,25 +1367,39 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	locked = false;
 	zs_unmap_object(meta->mem_pool, handle);
 
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	if (entry)
+		zram_dedup_insert(meta, entry, checksum);
+
+found_dup:
 	/*
 	 * Free memory associated with this sector
 	 * before overwriting unused sectors.
 	 */
-	write_lock(&zram->meta->tb_lock);
+	zram_slot_lock(meta, index);
 	zram_free_page(zram, index);
 
-	meta->table[index].handle = handle;
-	meta->table[index].size = clen;
-	write_unlock(&zram->meta->tb_lock);
+	if (entry)
+		meta->table[index].entry = entry;
+	else
+		meta->table[index].handle = handle;
+	zram_set_obj_size(meta, index, clen);
+	if (clen == PAGE_SIZE)
+		zram_set_flag(meta, index, ZRAM_HUGE);
+	zram_slot_unlock(meta, index);
 
 	/* Update stats */
-	atomic64_add(clen, &zram->stats.compr_data_size);
 	atomic64_inc(&zram->stats.pages_stored);
+	handle = 0;
 out:
 	if (locked)
 		zcomp_strm_release(zram->comp, zstrm);
-	if (is_partial_io(bvec))
-		kfree(uncmem);
+	/* slow path allocation left unused, e.g. the page is zero now */
+	if (handle)
+		zs_free(meta->mem_pool, handle);
+	kfree(new_entry);
+	if (tmp_page)
+		__free_page(tmp_page);
 	return ret;
 }
 
@@ -657,11 +1423,312 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 	return ret;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+#define HUGE_WRITEBACK	1
+#define IDLE_WRITEBACK	2
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index, blk_idx = 0;
+	struct page *page;
+	ssize_t ret = len;
+	int mode, err;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = IDLE_WRITEBACK;
+	else if (sysfs_streq(buf, "huge"))
+		mode = HUGE_WRITEBACK;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram->backing_dev) {
+		ret = -ENODEV;
+		goto release_init_lock;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto release_init_lock;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		if (!blk_idx) {
+			blk_idx = alloc_block_bdev(zram);
+			if (!blk_idx) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		zram_slot_lock(meta, index);
+		if (!meta->table[index].handle ||
+				zram_test_flag(meta, index, ZRAM_WB) ||
+				zram_test_flag(meta, index, ZRAM_UNDER_WB))
+			goto next;
+
+		if (mode == IDLE_WRITEBACK &&
+				!zram_test_flag(meta, index, ZRAM_IDLE))
+			goto next;
+		if (mode == HUGE_WRITEBACK &&
+				!zram_test_flag(meta, index, ZRAM_HUGE))
+			goto next;
+
+		/* Any free or overwrite of the slot clears ZRAM_UNDER_WB */
+		zram_set_flag(meta, index, ZRAM_UNDER_WB);
+		zram_slot_unlock(meta, index);
+
+		err = zram_decompress_page(zram, page, index);
+		if (!err)
+			err = zram_bdev_rw(zram, page, blk_idx, WRITE);
+		if (err) {
+			zram_slot_lock(meta, index);
+			zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+			zram_slot_unlock(meta, index);
+			ret = err;
+			continue;
+		}
+
+		atomic64_inc(&zram->stats.bd_writes);
+
+		zram_slot_lock(meta, index);
+		if (!zram_test_flag(meta, index, ZRAM_UNDER_WB))
+			goto next;
+
+		zram_free_page(zram, index);
+		zram_set_flag(meta, index, ZRAM_WB);
+		meta->table[index].handle = blk_idx;
+		atomic64_inc(&zram->stats.pages_stored);
+		blk_idx = 0;
+next:
+		zram_slot_unlock(meta, index);
+	}
+
+	if (blk_idx)
+		free_block_bdev(zram, blk_idx);
+	__free_page(page);
+release_init_lock:
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+#endif
+
+#define HUGE_RECOMP	1
+#define IDLE_RECOMP	2
+
+/*
+ * Recompress one slot with the secondary algorithm. The new object
+ * replaces the old one only if it is smaller and the slot was neither
+ * freed nor overwritten meanwhile.
+ */
+static int zram_recompress(struct zram *zram, u32 index, struct page *page,
+			struct zram_entry *entry)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm;
+	unsigned long handle;
+	unsigned char *src, *cmem;
+	size_t old_clen, clen;
+	bool idle;
+	int ret;
+
+	zram_slot_lock(meta, index);
+	old_clen = zram_get_obj_size(meta, index);
+	idle = zram_test_flag(meta, index, ZRAM_IDLE);
+	zram_set_flag(meta, index, ZRAM_UNDER_RECOMP);
+	zram_slot_unlock(meta, index);
+
+	ret = zram_decompress_page(zram, page, index);
+	if (ret)
+		goto out;
+
+	zstrm = zcomp_strm_find(zram->recomp);
+	src = kmap_atomic(page);
+	ret = zcomp_compress(zram->recomp, zstrm, src, &clen);
+	kunmap_atomic(src);
+	if (ret || clen >= old_clen || clen > max_zpage_size) {
+		zcomp_strm_release(zram->recomp, zstrm);
+		goto out;
+	}
+
+	handle = zs_malloc(meta->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM);
+	if (!handle) {
+		zcomp_strm_release(zram->recomp, zstrm);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zcomp_strm_release(zram->recomp, zstrm);
+	zs_unmap_object(meta->mem_pool, handle);
+
+	zram_slot_lock(meta, index);
+	if (!zram_test_flag(meta, index, ZRAM_UNDER_RECOMP)) {
+		zram_slot_unlock(meta, index);
+		zs_free(meta->mem_pool, handle);
+		return 0;
+	}
+
+	zram_free_page(zram, index);
+	if (entry) {
+		entry->handle = handle;
+		entry->len = clen;
+		entry->refcount = 1;
+		entry->pins = 0;
+		/* cold objects are not offered for deduplication */
+		RB_CLEAR_NODE(&entry->rb_node);
+		meta->table[index].entry = entry;
+	} else {
+		meta->table[index].handle = handle;
+	}
+	zram_set_obj_size(meta, index, clen);
+	zram_set_flag(meta, index, ZRAM_RECOMP);
+	if (idle)
+		zram_set_flag(meta, index, ZRAM_IDLE);
+	zram_slot_unlock(meta, index);
+
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	atomic64_inc(&zram->stats.pages_stored);
+	atomic64_add(clen, &zram->stats.recomp_data_size);
+	atomic64_inc(&zram->stats.recomp_pages);
+	/* entry is used */
+	return 1;
+out:
+	zram_slot_lock(meta, index);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+	zram_slot_unlock(meta, index);
+	return ret;
+}
+
+/*
+ * Accepts "type=idle|huge" and an optional "threshold=<bytes>" which
+ * limits recompression to objects of at least that size.
+ */
+static ssize_t recompress_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	struct zram_entry *entry = NULL;
+	unsigned long nr_pages, index, threshold = 0;
+	char *args, *param, *tmp;
+	struct page *page = NULL;
+	ssize_t ret = len;
+	int mode = 0, err;
+
+	args = kstrndup(buf, len, GFP_KERNEL);
+	if (!args)
+		return -ENOMEM;
+
+	tmp = strim(args);
+	while ((param = strsep(&tmp, " ")) != NULL) {
+		if (!*param)
+			continue;
+		if (!strcmp(param, "type=idle"))
+			mode = IDLE_RECOMP;
+		else if (!strcmp(param, "type=huge"))
+			mode = HUGE_RECOMP;
+		else if (!strncmp(param, "threshold=", 10) &&
+				!kstrtoul(param + 10, 10, &threshold) &&
+				threshold < PAGE_SIZE)
+			continue;
+		else
+			mode = -1;
+		if (mode < 0)
+			break;
+	}
+	kfree(args);
+
+	if (mode <= 0)
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram->recomp) {
+		ret = -ENODEV;
+		goto release_init_lock;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto release_init_lock;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		bool skip;
+
+		if (zram_dedup_enabled(meta) && !entry) {
+			entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+			if (!entry) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		zram_slot_lock(meta, index);
+		skip = !meta->table[index].handle ||
+			zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+			zram_test_flag(meta, index, ZRAM_RECOMP) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_RECOMP) ||
+			zram_get_obj_size(meta, index) < threshold;
+		if (mode == IDLE_RECOMP &&
+				!zram_test_flag(meta, index, ZRAM_IDLE))
+			skip = true;
+		if (mode == HUGE_RECOMP &&
+				!zram_test_flag(meta, index, ZRAM_HUGE))
+			skip = true;
+		/* shared objects are hot by definition */
+		if (zram_dedup_enabled(meta) && !skip &&
+				meta->table[index].entry->refcount > 1)
+			skip = true;
+		zram_slot_unlock(meta, index);
+		if (skip)
+			continue;
+
+		err = zram_recompress(zram, index, page, entry);
+		if (err > 0)
+			entry = NULL;
+		else if (err)
+			ret = err;
+
+		cond_resched();
+	}
+
+	kfree(entry);
+	__free_page(page);
+release_init_lock:
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+
 static void zram_reset_device(struct zram *zram, bool reset_capacity)
 {
 	down_write(&zram->init_lock);
 
 	zram->limit_pages = 0;
+	reset_bdev(zram);
 
 	if (!init_done(zram)) {
 		up_write(&zram->init_lock);
@@ -669,6 +1736,9 @@ static void zram_reset_device(struct zram *zram, bool reset_capacity)
 	}
 
 	zcomp_destroy(zram->comp);
+	if (zram->recomp)
+		zcomp_destroy(zram->recomp);
+	zram->recomp = NULL;
 	zram->max_comp_streams = 1;
 	zram_meta_free(zram->meta, zram->disksize);
 	zram->meta = NULL;
@@ -687,7 +1757,7 @@ static ssize_t disksize_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
 	u64 disksize;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp = NULL;
 	struct zram_meta *meta;
 	struct zram *zram = dev_to_zram(dev);
 	int err;
@@ -697,11 +1767,12 @@ static ssize_t disksize_store(struct device *dev,
 		return -EINVAL;
 
 	disksize = PAGE_ALIGN(disksize);
-	meta = zram_meta_alloc(disksize);
+	meta = zram_meta_alloc(disksize, zram->use_dedup);
 	if (!meta)
 		return -ENOMEM;
 
-	comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	comp = zcomp_create(zram->compressor, zram->percpu_comp_streams ?
+			ZCOMP_PERCPU_STREAMS : zram->max_comp_streams);
 	if (IS_ERR(comp)) {
 		pr_info("Cannot initialise %s compressing backend\n",
 				zram->compressor);
@@ -709,6 +1780,18 @@ static ssize_t disksize_store(struct device *dev,
 		goto out_free_meta;
 	}
 
+	/* recompression is a rare batch operation, one stream is enough */
+	if (zram->recomp_compressor[0]) {
+		recomp = zcomp_create(zram->recomp_compressor, 1);
+		if (IS_ERR(recomp)) {
+			pr_info("Cannot initialise %s recompressing backend\n",
+					zram->recomp_compressor);
+			err = PTR_ERR(recomp);
+			recomp = NULL;
+			goto out_destroy_comp_unlocked;
+		}
+	}
+
 	down_write(&zram->init_lock);
 	if (init_done(zram)) {
 		pr_info("Cannot change disksize for initialized device\n");
@@ -718,6 +1801,7 @@ static ssize_t disksize_store(struct device *dev,
 
 	zram->meta = meta;
 	zram->comp = comp;
+	zram->recomp = recomp;
 	zram->disksize = disksize;
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 	revalidate_disk(zram->disk);
@@ -726,6 +1810,9 @@ static ssize_t disksize_store(struct device *dev,
 
 out_destroy_comp:
 	up_write(&zram->init_lock);
+	if (recomp)
+		zcomp_destroy(recomp);
+out_destroy_comp_unlocked:
 	zcomp_destroy(comp);
 out_free_meta:
 	zram_meta_free(meta, disksize);
@@ -864,9 +1951,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	zram = bdev->bd_disk->private_data;
 	meta = zram->meta;
 
-	write_lock(&meta->tb_lock);
+	zram_slot_lock(meta, index);
 	zram_free_page(zram, index);
-	write_unlock(&meta->tb_lock);
+	zram_slot_unlock(meta, index);
 	atomic64_inc(&zram->stats.notify_free);
 }
 
@@ -885,10 +1972,25 @@ static DEVICE_ATTR(mem_limit, S_IRUGO | S_IWUSR, mem_limit_show,
 		mem_limit_store);
 static DEVICE_ATTR(mem_used_max, S_IRUGO | S_IWUSR, mem_used_max_show,
 		mem_used_max_store);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
 static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
 		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(percpu_comp_streams, S_IRUGO | S_IWUSR,
+		percpu_comp_streams_show, percpu_comp_streams_store);
 static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
 		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(recomp_algorithm, S_IRUGO | S_IWUSR,
+		recomp_algorithm_show, recomp_algorithm_store);
+static DEVICE_ATTR(recompress, S_IWUSR, NULL, recompress_store);
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+#endif
 
 ZRAM_ATTR_RO(num_reads);
 ZRAM_ATTR_RO(num_writes);
@@ -898,6 +2000,14 @@ ZRAM_ATTR_RO(invalid_io);
 ZRAM_ATTR_RO(notify_free);
 ZRAM_ATTR_RO(zero_pages);
 ZRAM_ATTR_RO(compr_data_size);
+ZRAM_ATTR_RO(dup_data_size);
+ZRAM_ATTR_RO(recomp_pages);
+ZRAM_ATTR_RO(recomp_data_size);
+#ifdef CONFIG_ZRAM_WRITEBACK
+ZRAM_ATTR_RO(bd_count);
+ZRAM_ATTR_RO(bd_reads);
+ZRAM_ATTR_RO(bd_writes);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -915,8 +2025,25 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_mem_used_total.attr,
 	&dev_attr_mem_limit.attr,
 	&dev_attr_mem_used_max.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_pages_compacted.attr,
 	&dev_attr_max_comp_streams.attr,
+	&dev_attr_percpu_comp_streams.attr,
 	&dev_attr_comp_algorithm.attr,
+	&dev_attr_recomp_algorithm.attr,
+	&dev_attr_recompress.attr,
+	&dev_attr_recomp_pages.attr,
+	&dev_attr_recomp_data_size.attr,
+	&dev_attr_use_dedup.attr,
+	&dev_attr_dup_data_size.attr,
+	&dev_attr_idle.attr,
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
+#endif
 	NULL,
 };
 
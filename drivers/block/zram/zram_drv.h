@@ -15,6 +15,7 @@
 #ifndef _ZRAM_DRV_H_
 #define _ZRAM_DRV_H_
 
+#include <linux/rbtree.h>
 #include <linux/spinlock.h>
 #include <linux/zsmalloc.h>
 #include "zcomp.h"
@@ -39,6 +40,13 @@ static const size_t max_zpage_size = PAGE_SIZE / 10 * 9;
  * always return failure.
  */
 
+/*
+ * Number of table entries per deduplication hash bucket. Each bucket
+ * has its own lock and rbtree so lookups from concurrent writers
+ * rarely contend.
+ */
+#define ZRAM_HASH_SHIFT		10
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -50,22 +58,59 @@ static const size_t max_zpage_size = PAGE_SIZE / 10 * 9;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value is for
+ * object size (excluding header), the higher bits is for
+ * zram_pageflags.
+ *
+ * zram is mainly used for memory efficiency so we want to keep memory
+ * footprint small so we can squeeze size and flags into a field.
+ */
+#define ZRAM_FLAG_SHIFT		(PAGE_SHIFT + 1)
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	ZRAM_ZERO = ZRAM_FLAG_SHIFT,
+	ZRAM_ACCESS,	/* page is now accessed, used as bit spinlock */
+	ZRAM_HUGE,	/* Incompressible page, stored uncompressed */
+	ZRAM_IDLE,	/* not accessed since last idle marking */
+	ZRAM_WB,	/* page is stored on backing device */
+	ZRAM_UNDER_WB,	/* page is being written to backing device */
+	ZRAM_RECOMP,	/* compressed with the secondary algorithm */
+	ZRAM_UNDER_RECOMP,	/* page is being recompressed */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * Compressed object shared by all table entries whose page content
+ * is identical. Only used when deduplication is enabled.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 len;
+	u32 checksum;
+	unsigned long refcount;	/* protected by zram_hash lock */
+	unsigned long pins;	/* of those, held by lookups; ditto */
+	unsigned long handle;
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
 /* Allocated for each disk page */
 struct table {
-	unsigned long handle;
-	u16 size;	/* object size (excluding header) */
-	u8 flags;
-} __aligned(4);
+	union {
+		unsigned long handle;
+		struct zram_entry *entry;	/* deduplication enabled */
+	};
+	unsigned long value;
+};
 
 struct zram_stats {
 	atomic64_t compr_data_size;	/* compressed size of pages stored */
@@ -77,13 +122,20 @@ struct zram_stats {
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
 	atomic64_t zero_pages;		/* no. of zero filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t dup_data_size;	/* compressed bytes saved by dedup */
+	atomic64_t bd_count;	/* no. of pages in backing device */
+	atomic64_t bd_reads;	/* no. of reads from backing device */
+	atomic64_t bd_writes;	/* no. of writes to backing device */
+	atomic64_t recomp_pages;	/* no. of pages in secondary algorithm */
+	atomic64_t recomp_data_size;	/* their compressed size */
 	atomic_long_t max_used_pages;	/* no. of maximum pages stored */
 };
 
 struct zram_meta {
-	rwlock_t tb_lock;	/* protect table */
 	struct table *table;
 	struct zs_pool *mem_pool;
+	struct zram_hash *hash;	/* NULL unless deduplication is enabled */
+	size_t hash_size;
 };
 
 struct zram {
@@ -91,6 +143,7 @@ struct zram {
 	struct request_queue *queue;
 	struct gendisk *disk;
 	struct zcomp *comp;
+	struct zcomp *recomp;	/* secondary algorithm for cold pages */
 
 	/* Prevent concurrent execution of device init, reset and R/W request */
 	struct rw_semaphore init_lock;
@@ -100,12 +153,24 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 	int max_comp_streams;
+	/* One compression stream per CPU instead of a shared idle list */
+	bool percpu_comp_streams;
 	struct zram_stats stats;
 	/*
 	 * the number of pages zram can consume for storing compressed data
 	 */
 	unsigned long limit_pages;
+	/* Share one compressed object between identical pages */
+	bool use_dedup;
 
 	char compressor[10];
+	char recomp_compressor[10];
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	unsigned long *bitmap;	/* allocated blocks of backing device */
+	unsigned long nr_pages;
+#endif
 };
 #endif
@@ -20,6 +20,7 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
+#include <linux/idr.h>
 #include <linux/ion.h>
 #include <linux/list.h>
 #include <linux/memblock.h>
@@ -27,6 +28,7 @@
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
@@ -42,15 +44,18 @@
 /**
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
- * @buffers:	an rb tree of all the existing buffers
- * @lock:		lock protecting the buffers & heaps trees
+ * @lock:		lock protecting the tree of clients
+ * @heap_lock:		lock protecting the tree of heaps; held for read
+ *			while allocating so heaps can allocate in parallel
  * @heaps:		list of all the heaps in the system
  * @user_clients:	list of all the clients created from userspace
+ *
+ * Buffers are indexed by the heap they came from, see struct ion_heap.
  */
 struct ion_device {
 	struct miscdevice dev;
-	struct rb_root buffers;
 	struct mutex lock;
+	struct rw_semaphore heap_lock;
 	struct rb_root heaps;
 	long (*custom_ioctl) (struct ion_client *client, unsigned int cmd,
 			      unsigned long arg);
@@ -62,8 +67,12 @@ struct ion_device {
  * struct ion_client - a process/hw block local address space
  * @node:		node in the tree of all clients
  * @dev:		backpointer to ion device
- * @handles:		an rb tree of all the handles in this client
- * @lock:		lock protecting the tree of handles
+ * @handles:		an rb tree of all the handles in this client, ordered
+ *			by the buffer they refer to
+ * @handle_ptrs:	the same handles ordered by address, to validate
+ *			handle pointers passed in by the kernel
+ * @idr:		maps the ids handed to userspace to handles
+ * @lock:		lock protecting the tree of handles and the idr
  * @heap_mask:		mask of all supported heaps
  * @name:		used for debugging
  * @task:		used for debugging
@@ -76,6 +85,8 @@ struct ion_client {
 	struct rb_node node;
 	struct ion_device *dev;
 	struct rb_root handles;
+	struct rb_root handle_ptrs;
+	struct idr idr;
 	struct mutex lock;
 	unsigned int heap_mask;
 	char *name;
@@ -90,8 +101,11 @@ struct ion_client {
  * @client:		back pointer to the client the buffer resides in
  * @buffer:		pointer to the buffer
  * @node:		node in the client's handle rbtree
+ * @ptr_node:		node in the client's handle_ptrs rbtree
  * @kmap_cnt:		count of times this client has mapped to kernel
  * @dmap_cnt:		count of times this client has mapped for dma
+ * @id:			client-unique id handed to userspace, 0 until the
+ *			handle has been added to the client
  *
  * Modifications to node, map_cnt or mapping should be protected by the
  * lock in the client.  Other fields are never changed after initialization.
@@ -101,20 +115,24 @@ struct ion_handle {
 	struct ion_client *client;
 	struct ion_buffer *buffer;
 	struct rb_node node;
+	struct rb_node ptr_node;
 	unsigned int kmap_cnt;
 	unsigned int iommu_map_cnt;
+	int id;
 };
 
 static void ion_iommu_release(struct kref *kref);
 
-/* this function should only be called while dev->lock is held */
-static void ion_buffer_add(struct ion_device *dev,
+static void ion_buffer_add(struct ion_heap *heap,
 			   struct ion_buffer *buffer)
 {
-	struct rb_node **p = &dev->buffers.rb_node;
+	struct rb_node **p;
 	struct rb_node *parent = NULL;
 	struct ion_buffer *entry;
 
+	mutex_lock(&heap->buffer_lock);
+	p = &heap->buffers.rb_node;
+
 	while (*p) {
 		parent = *p;
 		entry = rb_entry(parent, struct ion_buffer, node);
@@ -130,7 +148,8 @@ static void ion_buffer_add(struct ion_device *dev,
 	}
 
 	rb_link_node(&buffer->node, parent, p);
-	rb_insert_color(&buffer->node, &dev->buffers);
+	rb_insert_color(&buffer->node, &heap->buffers);
+	mutex_unlock(&heap->buffer_lock);
 }
 
 static void ion_iommu_add(struct ion_buffer *buffer,
@@ -188,7 +207,7 @@ static struct ion_iommu_map *ion_iommu_lookup(struct ion_buffer *buffer,
 	return NULL;
 }
 
-/* this function should only be called while dev->lock is held */
+/* this function should only be called while dev->heap_lock is held */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
 				     unsigned long len,
@@ -207,6 +226,11 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	kref_init(&buffer->ref);
 
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	if (ret && (heap->flags & ION_HEAP_FLAG_DEFER_FREE)) {
+		/* the memory may be sitting on the freelist */
+		ion_heap_freelist_drain(heap, 0);
+		ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	}
 	if (ret) {
 		kfree(buffer);
 		return ERR_PTR(ret);
@@ -225,7 +249,7 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->sg_table = table;
 
 	mutex_init(&buffer->lock);
-	ion_buffer_add(dev, buffer);
+	ion_buffer_add(heap, buffer);
 	return buffer;
 }
 
@@ -261,11 +285,8 @@ static void ion_iommu_delayed_unmap(struct ion_buffer *buffer)
 	mutex_unlock(&buffer->lock);
 }
 
-static void ion_buffer_destroy(struct kref *kref)
+void ion_buffer_destroy(struct ion_buffer *buffer)
 {
-	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
-	struct ion_device *dev = buffer->dev;
-
 	if (WARN_ON(buffer->kmap_cnt > 0))
 		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
 
@@ -273,12 +294,24 @@ static void ion_buffer_destroy(struct kref *kref)
 
 	ion_iommu_delayed_unmap(buffer);
 	buffer->heap->ops->free(buffer);
-	mutex_lock(&dev->lock);
-	rb_erase(&buffer->node, &dev->buffers);
-	mutex_unlock(&dev->lock);
 	kfree(buffer);
 }
 
+static void _ion_buffer_destroy(struct kref *kref)
+{
+	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
+	struct ion_heap *heap = buffer->heap;
+
+	mutex_lock(&heap->buffer_lock);
+	rb_erase(&buffer->node, &heap->buffers);
+	mutex_unlock(&heap->buffer_lock);
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_freelist_add(heap, buffer);
+	else
+		ion_buffer_destroy(buffer);
+}
+
 static void ion_buffer_get(struct ion_buffer *buffer)
 {
 	kref_get(&buffer->ref);
@@ -286,7 +319,7 @@ static void ion_buffer_get(struct ion_buffer *buffer)
 
 static int ion_buffer_put(struct ion_buffer *buffer)
 {
-	return kref_put(&buffer->ref, ion_buffer_destroy);
+	return kref_put(&buffer->ref, _ion_buffer_destroy);
 }
 
 static struct ion_handle *ion_handle_create(struct ion_client *client,
@@ -299,6 +332,7 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 		return ERR_PTR(-ENOMEM);
 	kref_init(&handle->ref);
 	rb_init_node(&handle->node);
+	rb_init_node(&handle->ptr_node);
 	handle->client = client;
 	ion_buffer_get(buffer);
 	handle->buffer = buffer;
@@ -319,8 +353,12 @@ static void ion_handle_destroy(struct kref *kref)
 		ion_handle_kmap_put(handle);
 	mutex_unlock(&buffer->lock);
 
+	if (handle->id)
+		idr_remove(&client->idr, handle->id);
 	if (!RB_EMPTY_NODE(&handle->node))
 		rb_erase(&handle->node, &client->handles);
+	if (!RB_EMPTY_NODE(&handle->ptr_node))
+		rb_erase(&handle->ptr_node, &client->handle_ptrs);
 
 	ion_buffer_put(buffer);
 	kfree(handle);
@@ -344,27 +382,44 @@ static int ion_handle_put(struct ion_handle *handle)
 static struct ion_handle *ion_handle_lookup(struct ion_client *client,
 					    struct ion_buffer *buffer)
 {
-	struct rb_node *n;
+	struct rb_node *n = client->handles.rb_node;
 
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
+	while (n) {
 		struct ion_handle *handle = rb_entry(n, struct ion_handle,
 						     node);
-		if (handle->buffer == buffer)
+		if (buffer < handle->buffer)
+			n = n->rb_left;
+		else if (buffer > handle->buffer)
+			n = n->rb_right;
+		else
 			return handle;
 	}
 	return NULL;
 }
 
+/* this function should only be called while client->lock is held */
+static struct ion_handle *ion_handle_lookup_id(struct ion_client *client,
+					       int id)
+{
+	if (id <= 0)
+		return NULL;
+	return idr_find(&client->idr, id);
+}
+
+/*
+ * The handle may be stale, so it is only compared against the client's
+ * handles and never dereferenced.
+ */
 static bool ion_handle_validate(struct ion_client *client, struct ion_handle *handle)
 {
-	struct rb_node *n = client->handles.rb_node;
+	struct rb_node *n = client->handle_ptrs.rb_node;
 
 	while (n) {
-		struct ion_handle *handle_node = rb_entry(n, struct ion_handle,
-							  node);
-		if (handle < handle_node)
+		struct ion_handle *entry = rb_entry(n, struct ion_handle,
+						    ptr_node);
+		if (handle < entry)
 			n = n->rb_left;
-		else if (handle > handle_node)
+		else if (handle > entry)
 			n = n->rb_right;
 		else
 			return true;
@@ -372,19 +427,30 @@ static bool ion_handle_validate(struct ion_client *client, struct ion_handle *ha
 	return false;
 }
 
-static void ion_handle_add(struct ion_client *client, struct ion_handle *handle)
+static int ion_handle_add(struct ion_client *client, struct ion_handle *handle)
 {
 	struct rb_node **p = &client->handles.rb_node;
 	struct rb_node *parent = NULL;
 	struct ion_handle *entry;
+	int id;
+	int ret;
+
+	do {
+		if (!idr_pre_get(&client->idr, GFP_KERNEL))
+			return -ENOMEM;
+		ret = idr_get_new_above(&client->idr, handle, 1, &id);
+	} while (ret == -EAGAIN);
+	if (ret)
+		return ret;
+	handle->id = id;
 
 	while (*p) {
 		parent = *p;
 		entry = rb_entry(parent, struct ion_handle, node);
 
-		if (handle < entry)
+		if (handle->buffer < entry->buffer)
 			p = &(*p)->rb_left;
-		else if (handle > entry)
+		else if (handle->buffer > entry->buffer)
 			p = &(*p)->rb_right;
 		else
 			WARN(1, "%s: buffer already found.", __func__);
@@ -392,7 +458,41 @@ static void ion_handle_add(struct ion_client *client, struct ion_handle *handle)
 
 	rb_link_node(&handle->node, parent, p);
 	rb_insert_color(&handle->node, &client->handles);
+
+	p = &client->handle_ptrs.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_handle, ptr_node);
+
+		if (handle < entry)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&handle->ptr_node, parent, p);
+	rb_insert_color(&handle->ptr_node, &client->handle_ptrs);
+	return 0;
+}
+
+/*
+ * Translates an id handed to userspace into a handle and takes a
+ * reference on it, which the caller drops with ion_free().
+ */
+struct ion_handle *ion_handle_get_by_id(struct ion_client *client, int id)
+{
+	struct ion_handle *handle;
+
+	mutex_lock(&client->lock);
+	handle = ion_handle_lookup_id(client, id);
+	if (handle)
+		ion_handle_get(handle);
+	mutex_unlock(&client->lock);
+
+	return handle ? handle : ERR_PTR(-EINVAL);
 }
+EXPORT_SYMBOL(ion_handle_get_by_id);
 
 struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 			     size_t align, unsigned int heap_mask,
@@ -420,7 +520,7 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 
 	len = PAGE_ALIGN(len);
 
-	mutex_lock(&dev->lock);
+	down_read(&dev->heap_lock);
 	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
 		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
 		/* if the client doesn't support this heap type */
@@ -452,7 +552,7 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 			}
 		}
 	}
-	mutex_unlock(&dev->lock);
+	up_read(&dev->heap_lock);
 
 	if (buffer == NULL)
 		return ERR_PTR(-ENODEV);
@@ -474,8 +574,14 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 	ion_buffer_put(buffer);
 
 	if (!IS_ERR(handle)) {
+		int ret;
+
 		mutex_lock(&client->lock);
-		ion_handle_add(client, handle);
+		ret = ion_handle_add(client, handle);
+		if (ret) {
+			ion_handle_put(handle);
+			handle = ERR_PTR(ret);
+		}
 		mutex_unlock(&client->lock);
 	}
 
@@ -937,6 +1043,8 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 
 	client->dev = dev;
 	client->handles = RB_ROOT;
+	client->handle_ptrs = RB_ROOT;
+	idr_init(&client->idr);
 	mutex_init(&client->lock);
 
 	client->name = kzalloc(name_len+1, GFP_KERNEL);
@@ -986,6 +1094,7 @@ void ion_client_destroy(struct ion_client *client)
 						     node);
 		ion_handle_destroy(&handle->ref);
 	}
+	idr_destroy(&client->idr);
 	mutex_lock(&dev->lock);
 	if (client->task)
 		put_task_struct(client->task);
@@ -1267,6 +1376,7 @@ struct ion_handle *ion_import_dma_buf(struct ion_client *client, int fd)
 	struct dma_buf *dmabuf;
 	struct ion_buffer *buffer;
 	struct ion_handle *handle;
+	int ret;
 
 	dmabuf = dma_buf_get(fd);
 	if (IS_ERR_OR_NULL(dmabuf))
@@ -1291,7 +1401,11 @@ struct ion_handle *ion_import_dma_buf(struct ion_client *client, int fd)
 	handle = ion_handle_create(client, buffer);
 	if (IS_ERR_OR_NULL(handle))
 		goto end;
-	ion_handle_add(client, handle);
+	ret = ion_handle_add(client, handle);
+	if (ret) {
+		ion_handle_put(handle);
+		handle = ERR_PTR(ret);
+	}
 end:
 	mutex_unlock(&client->lock);
 	dma_buf_put(dmabuf);
@@ -1299,6 +1413,11 @@ end:
 }
 EXPORT_SYMBOL(ion_import_dma_buf);
 
+static ion_user_handle_t ion_handle_to_user(struct ion_handle *handle)
+{
+	return (ion_user_handle_t)(unsigned long)handle->id;
+}
+
 static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct ion_client *client = filp->private_data;
@@ -1307,17 +1426,19 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case ION_IOC_ALLOC:
 	{
 		struct ion_allocation_data data;
+		struct ion_handle *handle;
 
 		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
 			return -EFAULT;
-		data.handle = ion_alloc(client, data.len, data.align,
+		handle = ion_alloc(client, data.len, data.align,
 					     data.heap_mask, data.flags);
 
-		if (IS_ERR(data.handle))
-			return PTR_ERR(data.handle);
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
 
+		data.handle = ion_handle_to_user(handle);
 		if (copy_to_user((void __user *)arg, &data, sizeof(data))) {
-			ion_free(client, data.handle);
+			ion_free(client, handle);
 			return -EFAULT;
 		}
 		break;
@@ -1325,32 +1446,43 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case ION_IOC_FREE:
 	{
 		struct ion_handle_data data;
-		bool valid;
+		struct ion_handle *handle;
 
 		if (copy_from_user(&data, (void __user *)arg,
 				   sizeof(struct ion_handle_data)))
 			return -EFAULT;
 		mutex_lock(&client->lock);
-		valid = ion_handle_validate(client, data.handle);
-		mutex_unlock(&client->lock);
-		if (!valid)
+		handle = ion_handle_lookup_id(client,
+					ion_user_handle_to_id(data.handle));
+		if (!handle) {
+			mutex_unlock(&client->lock);
 			return -EINVAL;
-		ion_free(client, data.handle);
+		}
+		ion_handle_put(handle);
+		mutex_unlock(&client->lock);
 		break;
 	}
 	case ION_IOC_MAP:
 	case ION_IOC_SHARE:
 	{
 		struct ion_fd_data data;
+		struct ion_handle *handle;
 		int ret;
 		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
 			return -EFAULT;
 
-		ret = ion_share_set_flags(client, data.handle, filp->f_flags);
+		handle = ion_handle_get_by_id(client,
+					ion_user_handle_to_id(data.handle));
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+
+		ret = ion_share_set_flags(client, handle, filp->f_flags);
+		if (!ret)
+			data.fd = ion_share_dma_buf(client, handle);
+		ion_free(client, handle);
 		if (ret)
 			return ret;
 
-		data.fd = ion_share_dma_buf(client, data.handle);
 		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
 			return -EFAULT;
 		if (data.fd < 0)
@@ -1360,14 +1492,17 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case ION_IOC_IMPORT:
 	{
 		struct ion_fd_data data;
+		struct ion_handle *handle;
 		int ret = 0;
 		if (copy_from_user(&data, (void __user *)arg,
 				   sizeof(struct ion_fd_data)))
 			return -EFAULT;
-		data.handle = ion_import_dma_buf(client, data.fd);
-		if (IS_ERR(data.handle)) {
-			ret = PTR_ERR(data.handle);
+		handle = ion_import_dma_buf(client, data.fd);
+		if (IS_ERR(handle)) {
+			ret = PTR_ERR(handle);
 			data.handle = NULL;
+		} else {
+			data.handle = ion_handle_to_user(handle);
 		}
 		if (copy_to_user((void __user *)arg, &data,
 				 sizeof(struct ion_fd_data)))
@@ -1543,24 +1678,24 @@ void ion_debug_mem_map_create(struct seq_file *s, struct ion_heap *heap,
 	struct ion_device *dev = heap->dev;
 	struct rb_node *n;
 
-	for (n = rb_first(&dev->buffers); n; n = rb_next(n)) {
+	mutex_lock(&heap->buffer_lock);
+	for (n = rb_first(&heap->buffers); n; n = rb_next(n)) {
 		struct ion_buffer *buffer =
 				rb_entry(n, struct ion_buffer, node);
-		if (buffer->heap->id == heap->id) {
-			struct mem_map_data *data =
-					kzalloc(sizeof(*data), GFP_KERNEL);
-			if (!data) {
-				seq_printf(s, "ERROR: out of memory. "
-					   "Part of memory map will not be logged\n");
-				break;
-			}
-			data->addr = buffer->priv_phys;
-			data->addr_end = buffer->priv_phys + buffer->size-1;
-			data->size = buffer->size;
-			data->client_name = ion_debug_locate_owner(dev, buffer);
-			ion_debug_mem_map_add(mem_map, data);
+		struct mem_map_data *data =
+				kzalloc(sizeof(*data), GFP_KERNEL);
+		if (!data) {
+			seq_printf(s, "ERROR: out of memory. "
+				   "Part of memory map will not be logged\n");
+			break;
 		}
+		data->addr = buffer->priv_phys;
+		data->addr_end = buffer->priv_phys + buffer->size-1;
+		data->size = buffer->size;
+		data->client_name = ion_debug_locate_owner(dev, buffer);
+		ion_debug_mem_map_add(mem_map, data);
 	}
+	mutex_unlock(&heap->buffer_lock);
 }
 
 /**
@@ -1621,6 +1756,9 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 				   client->pid, size);
 		}
 	}
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		seq_printf(s, "%16.s %16u\n", "deferred free",
+			   ion_heap_freelist_size(heap));
 	ion_heap_print_debug(s, heap);
 	mutex_unlock(&dev->lock);
 	return 0;
@@ -1650,7 +1788,13 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 		       __func__);
 
 	heap->dev = dev;
-	mutex_lock(&dev->lock);
+	heap->buffers = RB_ROOT;
+	mutex_init(&heap->buffer_lock);
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE) {
+		if (ion_heap_init_deferred_free(heap))
+			heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
+	}
+	down_write(&dev->heap_lock);
 	while (*p) {
 		parent = *p;
 		entry = rb_entry(parent, struct ion_heap, node);
@@ -1671,7 +1815,7 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
 			    &debug_heap_fops);
 end:
-	mutex_unlock(&dev->lock);
+	up_write(&dev->heap_lock);
 }
 
 int ion_secure_heap(struct ion_device *dev, int heap_id, int version,
@@ -1682,9 +1826,10 @@ int ion_secure_heap(struct ion_device *dev, int heap_id, int version,
 
 	/*
 	 * traverse the list of heaps available in this system
-	 * and find the heap that is specified.
+	 * and find the heap that is specified.  Allocations are kept out
+	 * while the heap changes state.
 	 */
-	mutex_lock(&dev->lock);
+	down_write(&dev->heap_lock);
 	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
 		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
 		if (heap->type != (enum ion_heap_type) ION_HEAP_TYPE_CP)
@@ -1697,7 +1842,7 @@ int ion_secure_heap(struct ion_device *dev, int heap_id, int version,
 			ret_val = -EINVAL;
 		break;
 	}
-	mutex_unlock(&dev->lock);
+	up_write(&dev->heap_lock);
 	return ret_val;
 }
 EXPORT_SYMBOL(ion_secure_heap);
@@ -1710,9 +1855,10 @@ int ion_unsecure_heap(struct ion_device *dev, int heap_id, int version,
 
 	/*
 	 * traverse the list of heaps available in this system
-	 * and find the heap that is specified.
+	 * and find the heap that is specified.  Allocations are kept out
+	 * while the heap changes state.
 	 */
-	mutex_lock(&dev->lock);
+	down_write(&dev->heap_lock);
 	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
 		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
 		if (heap->type != (enum ion_heap_type) ION_HEAP_TYPE_CP)
@@ -1725,7 +1871,7 @@ int ion_unsecure_heap(struct ion_device *dev, int heap_id, int version,
 			ret_val = -EINVAL;
 		break;
 	}
-	mutex_unlock(&dev->lock);
+	up_write(&dev->heap_lock);
 	return ret_val;
 }
 EXPORT_SYMBOL(ion_unsecure_heap);
@@ -1733,6 +1879,7 @@ EXPORT_SYMBOL(ion_unsecure_heap);
 static int ion_debug_leak_show(struct seq_file *s, void *unused)
 {
 	struct ion_device *dev = s->private;
+	struct rb_node *h;
 	struct rb_node *n;
 	struct rb_node *n2;
 
@@ -1740,11 +1887,18 @@ static int ion_debug_leak_show(struct seq_file *s, void *unused)
 	seq_printf(s, "%16.s %16.s %16.s %16.s\n", "buffer", "heap", "size",
 		"ref cnt");
 	mutex_lock(&dev->lock);
-	for (n = rb_first(&dev->buffers); n; n = rb_next(n)) {
-		struct ion_buffer *buf = rb_entry(n, struct ion_buffer,
-						     node);
+	down_read(&dev->heap_lock);
+	for (h = rb_first(&dev->heaps); h; h = rb_next(h)) {
+		struct ion_heap *heap = rb_entry(h, struct ion_heap, node);
+
+		mutex_lock(&heap->buffer_lock);
+		for (n = rb_first(&heap->buffers); n; n = rb_next(n)) {
+			struct ion_buffer *buf = rb_entry(n, struct ion_buffer,
+							  node);
 
-		buf->marked = 1;
+			buf->marked = 1;
+		}
+		mutex_unlock(&heap->buffer_lock);
 	}
 
 	/* now see which buffers we can access */
@@ -1765,15 +1919,22 @@ static int ion_debug_leak_show(struct seq_file *s, void *unused)
 	}
 
 	/* And anyone still marked as a 1 means a leaked handle somewhere */
-	for (n = rb_first(&dev->buffers); n; n = rb_next(n)) {
-		struct ion_buffer *buf = rb_entry(n, struct ion_buffer,
-						     node);
+	for (h = rb_first(&dev->heaps); h; h = rb_next(h)) {
+		struct ion_heap *heap = rb_entry(h, struct ion_heap, node);
 
-		if (buf->marked == 1)
-			seq_printf(s, "%16.x %16.s %16.x %16.d\n",
-				(int)buf, buf->heap->name, buf->size,
-				atomic_read(&buf->ref.refcount));
+		mutex_lock(&heap->buffer_lock);
+		for (n = rb_first(&heap->buffers); n; n = rb_next(n)) {
+			struct ion_buffer *buf = rb_entry(n, struct ion_buffer,
+							  node);
+
+			if (buf->marked == 1)
+				seq_printf(s, "%16.x %16.s %16.x %16.d\n",
+					(int)buf, buf->heap->name, buf->size,
+					atomic_read(&buf->ref.refcount));
+		}
+		mutex_unlock(&heap->buffer_lock);
 	}
+	up_read(&dev->heap_lock);
 	mutex_unlock(&dev->lock);
 	return 0;
 }
@@ -1819,8 +1980,8 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 		pr_err("ion: failed to create debug files.\n");
 
 	idev->custom_ioctl = custom_ioctl;
-	idev->buffers = RB_ROOT;
 	mutex_init(&idev->lock);
+	init_rwsem(&idev->heap_lock);
 	idev->heaps = RB_ROOT;
 	idev->clients = RB_ROOT;
 	debugfs_create_file("check_leaked_fds", 0664, idev->debug_root, idev,
@@ -0,0 +1,249 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/*
+ * Blocks sitting in a pool belong to nobody else, so they are chained
+ * through page->lru of their first page.
+ */
+
+static LIST_HEAD(pools);
+static DEFINE_MUTEX(pools_lock);
+
+static void ion_page_pool_zero(struct page *page, unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < (1 << order); i++)
+		clear_highpage(page + i);
+}
+
+static struct page *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+{
+	return alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+}
+
+static void ion_page_pool_free_pages(struct ion_page_pool *pool,
+				     struct page *page)
+{
+	__free_pages(page, pool->order);
+}
+
+/* Zero the blocks handed back by ion_page_pool_free. */
+static void ion_page_pool_zero_work(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  zero_work);
+	struct page *page;
+
+	mutex_lock(&pool->mutex);
+	while (!list_empty(&pool->dirty_items)) {
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		list_del(&page->lru);
+		pool->dirty_count--;
+		mutex_unlock(&pool->mutex);
+
+		ion_page_pool_zero(page, pool->order);
+
+		mutex_lock(&pool->mutex);
+		list_add_tail(&page->lru, &pool->clean_items);
+		pool->clean_count++;
+	}
+	mutex_unlock(&pool->mutex);
+}
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool,
+					 bool *dirty)
+{
+	struct page *page = NULL;
+
+	if (!list_empty(&pool->clean_items)) {
+		page = list_first_entry(&pool->clean_items, struct page, lru);
+		pool->clean_count--;
+		*dirty = false;
+	} else if (!list_empty(&pool->dirty_items)) {
+		page = list_first_entry(&pool->dirty_items, struct page, lru);
+		pool->dirty_count--;
+		*dirty = true;
+	}
+	if (page)
+		list_del(&page->lru);
+	return page;
+}
+
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page;
+	bool dirty;
+
+	mutex_lock(&pool->mutex);
+	page = ion_page_pool_remove(pool, &dirty);
+	mutex_unlock(&pool->mutex);
+
+	if (!page)
+		return ion_page_pool_alloc_pages(pool);
+
+	/* the worker has not got to this one yet */
+	if (dirty)
+		ion_page_pool_zero(page, pool->order);
+	return page;
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	mutex_lock(&pool->mutex);
+	list_add_tail(&page->lru, &pool->dirty_items);
+	pool->dirty_count++;
+	mutex_unlock(&pool->mutex);
+
+	schedule_work(&pool->zero_work);
+}
+
+static int ion_page_pool_total(struct ion_page_pool *pool)
+{
+	return (pool->clean_count + pool->dirty_count) << pool->order;
+}
+
+/*
+ * Give up to @nr_to_scan pages worth of cached blocks back to the
+ * system, dirty ones first since nobody has paid to zero them yet.
+ * Returns the number of pages still cached.
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	struct page *page;
+	int freed = 0;
+	int total;
+
+	mutex_lock(&pool->mutex);
+	while (freed < nr_to_scan) {
+		if (!list_empty(&pool->dirty_items)) {
+			page = list_first_entry(&pool->dirty_items,
+						struct page, lru);
+			pool->dirty_count--;
+		} else if (!list_empty(&pool->clean_items)) {
+			page = list_first_entry(&pool->clean_items,
+						struct page, lru);
+			pool->clean_count--;
+		} else {
+			break;
+		}
+		list_del(&page->lru);
+		ion_page_pool_free_pages(pool, page);
+		freed += (1 << pool->order);
+	}
+	total = ion_page_pool_total(pool);
+	mutex_unlock(&pool->mutex);
+
+	return total;
+}
+
+void ion_page_pool_stats(struct ion_page_pool *pool, int *clean, int *dirty)
+{
+	mutex_lock(&pool->mutex);
+	*clean = pool->clean_count;
+	*dirty = pool->dirty_count;
+	mutex_unlock(&pool->mutex);
+}
+
+static int ion_page_pool_shrink_all(struct shrinker *shrinker,
+				    struct shrink_control *sc)
+{
+	struct ion_page_pool *pool;
+	int nr_to_scan = sc->nr_to_scan;
+	int total = 0;
+
+	/*
+	 * Buffers are allocated and freed with GFP_KERNEL, so only
+	 * reclaim that may enter the filesystem can wait on the pools.
+	 */
+	if (nr_to_scan && !(sc->gfp_mask & __GFP_FS))
+		return -1;
+
+	mutex_lock(&pools_lock);
+	list_for_each_entry(pool, &pools, list) {
+		int left = ion_page_pool_total(pool);
+
+		if (nr_to_scan > 0) {
+			int before = left;
+
+			left = ion_page_pool_shrink(pool, nr_to_scan);
+			nr_to_scan -= min(nr_to_scan, before - left);
+		}
+		total += left;
+	}
+	mutex_unlock(&pools_lock);
+
+	return total;
+}
+
+static struct shrinker ion_page_pool_shrinker = {
+	.shrink = ion_page_pool_shrink_all,
+	.seeks = DEFAULT_SEEKS,
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool;
+
+	pool = kzalloc(sizeof(struct ion_page_pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	mutex_init(&pool->mutex);
+	INIT_WORK(&pool->zero_work, ion_page_pool_zero_work);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+
+	mutex_lock(&pools_lock);
+	list_add(&pool->list, &pools);
+	mutex_unlock(&pools_lock);
+
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	mutex_lock(&pools_lock);
+	list_del(&pool->list);
+	mutex_unlock(&pools_lock);
+
+	cancel_work_sync(&pool->zero_work);
+	ion_page_pool_shrink(pool, INT_MAX);
+	kfree(pool);
+}
+
+static int __init ion_page_pool_init(void)
+{
+	register_shrinker(&ion_page_pool_shrinker);
+	return 0;
+}
+
+static void __exit ion_page_pool_exit(void)
+{
+	unregister_shrinker(&ion_page_pool_shrinker);
+}
+
+module_init(ion_page_pool_init);
+module_exit(ion_page_pool_exit);
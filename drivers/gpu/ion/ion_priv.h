@@ -25,6 +25,10 @@
 #include <linux/ion.h>
 #include <linux/iommu.h>
 #include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 enum {
 	DI_PARTITION_NUM = 0,
@@ -64,10 +68,30 @@ struct ion_iommu_map {
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 
+/**
+ * ion_handle_get_by_id - look up a handle from the id userspace knows it by
+ * @client:	the client the handle belongs to
+ * @id:		id returned to userspace by ION_IOC_ALLOC or ION_IOC_IMPORT
+ *
+ * Takes a reference on the handle, which must be dropped with ion_free().
+ * Returns ERR_PTR(-EINVAL) if @client has no handle with that id.
+ */
+struct ion_handle *ion_handle_get_by_id(struct ion_client *client, int id);
+
+/*
+ * Userspace is given small integer ids rather than the handle pointers,
+ * carried in the pointer sized handle fields of the ioctl structures.
+ */
+static inline int ion_user_handle_to_id(ion_user_handle_t handle)
+{
+	return (int)(unsigned long)handle;
+}
+
 /**
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
- * @node:		node in the ion_device buffers tree
+ * @node:		node in the buffers tree of the heap
+ * @list:		element in the heap's freelist once released
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
  * @flags:		buffer specific flags
@@ -84,7 +108,10 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 */
 struct ion_buffer {
 	struct kref ref;
-	struct rb_node node;
+	union {
+		struct rb_node node;
+		struct list_head list;
+	};
 	struct ion_device *dev;
 	struct ion_heap *heap;
 	unsigned long flags;
@@ -160,6 +187,16 @@ struct ion_heap_ops {
  *			MUST be unique
  * @name:		used for debugging
  * @priv:		private heap data
+ * @buffers:		an rb tree of all the buffers allocated from this heap
+ * @buffer_lock:	lock protecting @buffers
+ * @flags:		ION_HEAP_FLAG_* set by the heap implementation
+ * @free_list:		released buffers waiting to be freed, if the heap
+ *			defers freeing
+ * @free_list_size:	total size of the buffers on @free_list
+ * @free_lock:		lock protecting @free_list and @free_list_size
+ * @waitqueue:		wakes @task when buffers are queued
+ * @task:		thread freeing the buffers on @free_list
+ * @shrinker:		drains @free_list under memory pressure
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -174,8 +211,42 @@ struct ion_heap {
 	int id;
 	const char *name;
 	void *priv;
+	struct rb_root buffers;
+	struct mutex buffer_lock;
+	unsigned long flags;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct shrinker shrinker;
 };
 
+/*
+ * Set by heaps whose buffers should be freed from a kernel thread
+ * rather than by whoever drops the last reference.
+ */
+#define ION_HEAP_FLAG_DEFER_FREE	(1 << 0)
+
+/**
+ * ion_buffer_destroy - free a buffer's memory and the buffer itself
+ * @buffer:		buffer with no references left
+ */
+void ion_buffer_destroy(struct ion_buffer *buffer);
+
+/**
+ * functions for deferred freeing, see ION_HEAP_FLAG_DEFER_FREE
+ *
+ * ion_heap_init_deferred_free is called for such heaps when they are
+ * added to the device, and undone by ion_heap_destroy.
+ * ion_heap_freelist_drain frees up to @size
+ * bytes of queued buffers synchronously, all of them if @size is 0.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
 /**
  * struct mem_map_data - represents information about the memory map for a heap
  * @node:		rb node used to store in the tree of mem_map_data
@@ -247,6 +318,42 @@ void ion_cp_heap_destroy(struct ion_heap *);
 struct ion_heap *ion_reusable_heap_create(struct ion_platform_heap *);
 void ion_reusable_heap_destroy(struct ion_heap *);
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @clean_count:	number of zeroed blocks ready to hand out
+ * @dirty_count:	number of freed blocks waiting to be zeroed
+ * @clean_items:	list of zeroed blocks
+ * @dirty_items:	list of blocks waiting for @zero_work
+ * @mutex:		protects the lists and counts
+ * @zero_work:		zeroes freed blocks off the allocation path
+ * @gfp_mask:		gfp_mask to use for fresh allocations
+ * @order:		order of the blocks in the pool
+ * @list:		plugs the pool into the list walked by the shrinker
+ *
+ * Allows a heap to keep freed blocks of one order around instead of
+ * returning them to the buddy allocator.  Freed blocks are zeroed in
+ * the background, so the next allocation usually gets one for free.
+ * All pools are shrunk by a common shrinker under memory pressure.
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	struct mutex mutex;
+	struct work_struct zero_work;
+	gfp_t gfp_mask;
+	unsigned int order;
+	struct list_head list;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan);
+void ion_page_pool_stats(struct ion_page_pool *pool, int *clean, int *dirty);
+
 /**
  * kernel api to allocate/free from carveout -- used when carveout is
  * used to back an architecture specific custom heap
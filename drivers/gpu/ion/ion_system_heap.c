@@ -35,49 +35,145 @@ static atomic_t system_contig_heap_allocated;
 static unsigned int system_heap_has_outer_cache;
 static unsigned int system_heap_contig_has_outer_cache;
 
+/*
+ * Buffers are built from the largest blocks available, so a large
+ * buffer needs a fraction of the allocations and sg entries it would
+ * take page by page.  High orders are tried opportunistically and must
+ * not stall the caller in reclaim or compaction.
+ */
+static const unsigned int orders[] = {8, 4, 0};
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+static gfp_t high_order_gfp_flags = (GFP_KERNEL | __GFP_NOWARN |
+				     __GFP_NORETRY | __GFP_NO_KSWAPD) &
+				    ~__GFP_WAIT;
+static gfp_t low_order_gfp_flags = GFP_KERNEL | __GFP_NOWARN;
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+};
+
+struct page_info {
+	struct page *page;
+	unsigned int order;
+	struct list_head list;
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
+						 unsigned long size,
+						 unsigned int max_order)
+{
+	struct page_info *info;
+	struct page *page;
+	int i;
+
+	info = kmalloc(sizeof(struct page_info), GFP_KERNEL);
+	if (!info)
+		return NULL;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(heap->pools[i]);
+		if (!page)
+			continue;
+
+		info->page = page;
+		info->order = orders[i];
+		return info;
+	}
+	kfree(info);
+	return NULL;
+}
+
+static void free_buffer_page(struct ion_system_heap *heap, struct page *page,
+			     unsigned int order)
+{
+	ion_page_pool_free(heap->pools[order_to_index(order)], page);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
 				     unsigned long flags)
 {
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
 	struct sg_table *table;
 	struct scatterlist *sg;
-	int i, j;
-	int npages = PAGE_ALIGN(size) / PAGE_SIZE;
+	struct list_head pages;
+	struct page_info *info, *tmp_info;
+	long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+	int i = 0;
+
+	INIT_LIST_HEAD(&pages);
+	while (size_remaining > 0) {
+		info = alloc_largest_available(sys_heap, size_remaining,
+					       max_order);
+		if (!info)
+			goto err;
+		list_add_tail(&info->list, &pages);
+		size_remaining -= PAGE_SIZE << info->order;
+		/* an order that failed once is not worth retrying */
+		max_order = info->order;
+		i++;
+	}
 
 	table = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
 	if (!table)
-		return -ENOMEM;
-	i = sg_alloc_table(table, npages, GFP_KERNEL);
-	if (i)
-		goto err0;
-	for_each_sg(table->sgl, sg, table->nents, i) {
-		struct page *page;
-		page = alloc_page(GFP_KERNEL|__GFP_ZERO);
-		if (!page)
-			goto err1;
-		sg_set_page(sg, page, PAGE_SIZE, 0);
+		goto err;
+	if (sg_alloc_table(table, i, GFP_KERNEL))
+		goto err1;
+
+	sg = table->sgl;
+	list_for_each_entry_safe(info, tmp_info, &pages, list) {
+		sg_set_page(sg, info->page, PAGE_SIZE << info->order, 0);
+		sg = sg_next(sg);
+		list_del(&info->list);
+		kfree(info);
 	}
+
 	buffer->priv_virt = table;
 	atomic_add(size, &system_heap_allocated);
 	return 0;
 err1:
-	for_each_sg(table->sgl, sg, i, j)
-		__free_page(sg_page(sg));
-	sg_free_table(table);
-err0:
 	kfree(table);
+err:
+	list_for_each_entry_safe(info, tmp_info, &pages, list) {
+		free_buffer_page(sys_heap, info->page, info->order);
+		kfree(info);
+	}
 	return -ENOMEM;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
+	struct ion_system_heap *sys_heap = container_of(buffer->heap,
+							struct ion_system_heap,
+							heap);
 	int i;
 	struct scatterlist *sg;
 	struct sg_table *table = buffer->priv_virt;
 
 	for_each_sg(table->sgl, sg, table->nents, i)
-		__free_page(sg_page(sg));
+		free_buffer_page(sys_heap, sg_page(sg), get_order(sg->length));
 	if (buffer->sg_table)
 		sg_free_table(buffer->sg_table);
 	kfree(buffer->sg_table);
@@ -104,17 +200,26 @@ void *ion_system_heap_map_kernel(struct ion_heap *heap,
 		return ERR_PTR(-EINVAL);
 	} else {
 		struct scatterlist *sg;
-		int i;
+		int i, j;
 		void *vaddr;
 		struct sg_table *table = buffer->priv_virt;
-		struct page **pages = kmalloc(
-					sizeof(struct page *) * table->nents,
-					GFP_KERNEL);
+		int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+		struct page **pages = vmalloc(sizeof(struct page *) * npages);
+		struct page **tmp = pages;
 
-		for_each_sg(table->sgl, sg, table->nents, i)
-			pages[i] = sg_page(sg);
-		vaddr = vmap(pages, table->nents, VM_MAP, PAGE_KERNEL);
-		kfree(pages);
+		if (!pages)
+			return ERR_PTR(-ENOMEM);
+
+		for_each_sg(table->sgl, sg, table->nents, i) {
+			int npages_this_entry = PAGE_ALIGN(sg->length) /
+						PAGE_SIZE;
+			struct page *page = sg_page(sg);
+
+			for (j = 0; j < npages_this_entry; j++)
+				*(tmp++) = page++;
+		}
+		vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+		vfree(pages);
 
 		return vaddr;
 	}
@@ -161,17 +266,37 @@ int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 	} else {
 		struct sg_table *table = buffer->priv_virt;
 		unsigned long addr = vma->vm_start;
-		unsigned long offset = vma->vm_pgoff;
+		unsigned long offset = vma->vm_pgoff * PAGE_SIZE;
 		struct scatterlist *sg;
 		int i;
+		int ret;
 
+		/*
+		 * Only the first page of a high order block is refcounted,
+		 * so the blocks are mapped by pfn rather than page by page
+		 * with vm_insert_page.
+		 */
 		for_each_sg(table->sgl, sg, table->nents, i) {
-			if (offset) {
-				offset--;
+			struct page *page = sg_page(sg);
+			unsigned long remainder = vma->vm_end - addr;
+			unsigned long len = sg->length;
+
+			if (offset >= sg->length) {
+				offset -= sg->length;
 				continue;
+			} else if (offset) {
+				page += offset / PAGE_SIZE;
+				len = sg->length - offset;
+				offset = 0;
 			}
-			vm_insert_page(vma, addr, sg_page(sg));
-			addr += PAGE_SIZE;
+			len = min(len, remainder);
+			ret = remap_pfn_range(vma, addr, page_to_pfn(page), len,
+					      vma->vm_page_prot);
+			if (ret)
+				return ret;
+			addr += len;
+			if (addr >= vma->vm_end)
+				break;
 		}
 		return 0;
 	}
@@ -231,7 +356,7 @@ int ion_system_heap_cache_ops(struct ion_heap *heap, struct ion_buffer *buffer,
 				WARN(1, "Could not translate virtual address to physical address\n");
 				return -EINVAL;
 			}
-			outer_cache_op(pstart, pstart + PAGE_SIZE);
+			outer_cache_op(pstart, pstart + sg->length);
 		}
 	}
 	return 0;
@@ -240,8 +365,20 @@ int ion_system_heap_cache_ops(struct ion_heap *heap, struct ion_buffer *buffer,
 static int ion_system_print_debug(struct ion_heap *heap, struct seq_file *s,
 				  const struct rb_root *unused)
 {
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i, clean, dirty;
+
 	seq_printf(s, "total bytes currently allocated: %lx\n",
 			(unsigned long) atomic_read(&system_heap_allocated));
+	for (i = 0; i < NUM_ORDERS; i++) {
+		ion_page_pool_stats(sys_heap->pools[i], &clean, &dirty);
+		seq_printf(s, "order %u pool: %d zeroed %d dirty (%lu bytes)\n",
+			   orders[i], clean, dirty,
+			   (unsigned long)(clean + dirty) *
+			   (PAGE_SIZE << orders[i]));
+	}
 
 	return 0;
 }
@@ -328,20 +465,46 @@ static struct ion_heap_ops vmalloc_ops = {
 
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *pheap)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *heap;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
+	heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
 	if (!heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
+	heap->heap.ops = &vmalloc_ops;
+	heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+	heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
+	for (i = 0; i < NUM_ORDERS; i++) {
+		gfp_t gfp_flags = low_order_gfp_flags;
+
+		if (orders[i] > 4)
+			gfp_flags = high_order_gfp_flags;
+		else if (orders[i] == 0)
+			gfp_flags = GFP_KERNEL;
+		heap->pools[i] = ion_page_pool_create(gfp_flags, orders[i]);
+		if (!heap->pools[i])
+			goto err_create_pool;
+	}
 	system_heap_has_outer_cache = pheap->has_outer_cache;
-	return heap;
+	return &heap->heap;
+
+err_create_pool:
+	while (i--)
+		ion_page_pool_destroy(heap->pools[i]);
+	kfree(heap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -625,15 +625,18 @@ static long msm_ion_custom_ioctl(struct ion_client *client,
 					__func__, (int)handle);
 				return -EINVAL;
 			}
+		} else {
+			handle = ion_handle_get_by_id(client,
+					ion_user_handle_to_id(data.handle));
+			if (IS_ERR(handle))
+				return PTR_ERR(handle);
 		}
 
-		ret = ion_do_cache_op(client,
-				data.handle ? data.handle : handle,
+		ret = ion_do_cache_op(client, handle,
 				data.vaddr, data.offset, data.length,
 				cmd);
 
-		if (!data.handle)
-			ion_free(client, handle);
+		ion_free(client, handle);
 
 		if (ret < 0)
 			return ret;
@@ -643,12 +646,18 @@ static long msm_ion_custom_ioctl(struct ion_client *client,
 	case ION_IOC_GET_FLAGS:
 	{
 		struct ion_flag_data data;
+		struct ion_handle *handle;
 		int ret;
 		if (copy_from_user(&data, (void __user *)arg,
 					sizeof(struct ion_flag_data)))
 			return -EFAULT;
 
-		ret = ion_handle_get_flags(client, data.handle, &data.flags);
+		handle = ion_handle_get_by_id(client,
+					ion_user_handle_to_id(data.handle));
+		if (IS_ERR(handle))
+			return PTR_ERR(handle);
+		ret = ion_handle_get_flags(client, handle, &data.flags);
+		ion_free(client, handle);
 		if (ret < 0)
 			return ret;
 		if (copy_to_user((void __user *)arg, &data,
@@ -20,6 +20,7 @@
 #include <linux/file.h>
 #include <linux/mm.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/debugfs.h>
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
@@ -104,6 +105,18 @@ struct pmem_bits {
 	unsigned order:7;		/* size of the region in pmem space */
 };
 
+/* a run of quanta in the extent allocator, either free or allocated */
+struct pmem_extent {
+	/* entry in free_by_size while free */
+	struct rb_node size_node;
+	/* entry in free_by_addr while free, in allocated otherwise */
+	struct rb_node addr_node;
+	/* first quantum of the run */
+	unsigned long start;
+	/* length of the run in quanta */
+	unsigned long quanta;
+};
+
 struct pmem_region_node {
 	struct pmem_region region;
 	struct list_head list;
@@ -204,6 +217,18 @@ struct pmem_info {
 			unsigned long used;      /* Bytes currently allocated */
 			struct list_head alist;  /* List of allocations       */
 		} system_mem;
+
+		struct {
+			/* free extents ordered by length, then address */
+			struct rb_root free_by_size;
+			/* free extents ordered by address */
+			struct rb_root free_by_addr;
+			/* allocated extents ordered by address */
+			struct rb_root allocated;
+			unsigned long free_quanta;
+			unsigned long free_extents;
+			unsigned long allocations;
+		} extent;
 	} allocator;
 
 	int id;
@@ -361,6 +386,8 @@ static ssize_t show_pmem_allocator_type(int id, char *buf)
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "Buddy Bestfit");
 	case  PMEM_ALLOCATORTYPE_BITMAP:
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "Bitmap");
+	case  PMEM_ALLOCATORTYPE_EXTENT:
+		return scnprintf(buf, PAGE_SIZE, "%s\n", "Extent tree");
 	case PMEM_ALLOCATORTYPE_SYSTEM:
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "System heap");
 	default:
@@ -495,8 +522,12 @@ static ssize_t show_pmem_free_quanta(int id, char *buf)
 	ssize_t ret;
 
 	mutex_lock(&pmem[id].arena_mutex);
-	ret = scnprintf(buf, PAGE_SIZE, "%u\n",
-		pmem[id].allocator.bitmap.bitmap_free);
+	if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_EXTENT)
+		ret = scnprintf(buf, PAGE_SIZE, "%lu\n",
+			pmem[id].allocator.extent.free_quanta);
+	else
+		ret = scnprintf(buf, PAGE_SIZE, "%u\n",
+			pmem[id].allocator.bitmap.bitmap_free);
 	mutex_unlock(&pmem[id].arena_mutex);
 	return ret;
 }
@@ -559,6 +590,56 @@ static struct attribute *pmem_bitmap_attrs[] = {
 	NULL
 };
 
+static unsigned long pmem_extent_largest(int id)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct rb_node *node;
+
+	node = rb_last(&pmem[id].allocator.extent.free_by_size);
+	if (!node)
+		return 0;
+	return rb_entry(node, struct pmem_extent, size_node)->quanta;
+}
+
+static ssize_t show_pmem_fragmentation(int id, char *buf)
+{
+	unsigned long free, largest;
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	free = pmem[id].allocator.extent.free_quanta;
+	largest = pmem_extent_largest(id);
+	/*
+	 * The share of free memory which is not in the largest free extent,
+	 * i.e. unusable for the largest allocation the region could satisfy
+	 * if it were not fragmented.
+	 */
+	ret = scnprintf(buf, PAGE_SIZE,
+		"allocations: %lu\n"
+		"free extents: %lu\n"
+		"free quanta: %lu\n"
+		"largest free extent: %lu quanta\n"
+		"fragmentation: %lu%%\n",
+		pmem[id].allocator.extent.allocations,
+		pmem[id].allocator.extent.free_extents,
+		free, largest,
+		free ? (free - largest) * 100 / free : 0);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(fragmentation);
+
+static struct attribute *pmem_extent_attrs[] = {
+	PMEM_COMMON_SYSFS_ATTRS,
+
+	PMEM_BITMAP_BUDDY_BESTFIT_COMMON_SYSFS_ATTRS,
+
+	&pmem_attr_free_quanta.attr,
+	&pmem_attr_fragmentation.attr,
+
+	NULL
+};
+
 static struct attribute *pmem_system_attrs[] = {
 	PMEM_COMMON_SYSFS_ATTRS,
 
@@ -570,6 +651,11 @@ static struct kobj_type pmem_bitmap_ktype = {
 	.default_attrs = pmem_bitmap_attrs,
 };
 
+static struct kobj_type pmem_extent_ktype = {
+	.sysfs_ops = &pmem_ops,
+	.default_attrs = pmem_extent_attrs,
+};
+
 static struct kobj_type pmem_system_ktype = {
 	.sysfs_ops = &pmem_ops,
 	.default_attrs = pmem_system_attrs,
@@ -920,6 +1006,157 @@ static int pmem_free_space_system(int id, struct pmem_freespace *fs)
 	return 0;
 }
 
+/*
+ * The extent allocator keeps its free extents in two rbtrees, one ordered
+ * by length for best-fit allocation and one ordered by address to find the
+ * neighbours to coalesce with on free, and its allocations in a third one,
+ * so that every operation is O(log n) in the number of extents.
+ */
+static void pmem_extent_insert_addr(struct rb_root *root,
+		struct pmem_extent *ext)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct pmem_extent *curr;
+
+	while (*p) {
+		parent = *p;
+		curr = rb_entry(parent, struct pmem_extent, addr_node);
+		if (ext->start < curr->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->addr_node, parent, p);
+	rb_insert_color(&ext->addr_node, root);
+}
+
+static struct pmem_extent *pmem_extent_find(struct rb_root *root,
+		unsigned long start)
+{
+	struct rb_node *node = root->rb_node;
+	struct pmem_extent *curr;
+
+	while (node) {
+		curr = rb_entry(node, struct pmem_extent, addr_node);
+		if (start < curr->start)
+			node = node->rb_left;
+		else if (start > curr->start)
+			node = node->rb_right;
+		else
+			return curr;
+	}
+	return NULL;
+}
+
+static void pmem_extent_insert_free(int id, struct pmem_extent *ext)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct rb_node **p = &pmem[id].allocator.extent.free_by_size.rb_node;
+	struct rb_node *parent = NULL;
+	struct pmem_extent *curr;
+
+	while (*p) {
+		parent = *p;
+		curr = rb_entry(parent, struct pmem_extent, size_node);
+		if (ext->quanta < curr->quanta ||
+		    (ext->quanta == curr->quanta && ext->start < curr->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->size_node, parent, p);
+	rb_insert_color(&ext->size_node,
+			&pmem[id].allocator.extent.free_by_size);
+
+	pmem_extent_insert_addr(&pmem[id].allocator.extent.free_by_addr, ext);
+	pmem[id].allocator.extent.free_quanta += ext->quanta;
+	pmem[id].allocator.extent.free_extents++;
+}
+
+static void pmem_extent_erase_free(int id, struct pmem_extent *ext)
+{
+	/* caller should hold the lock on arena_mutex! */
+	rb_erase(&ext->size_node, &pmem[id].allocator.extent.free_by_size);
+	rb_erase(&ext->addr_node, &pmem[id].allocator.extent.free_by_addr);
+	pmem[id].allocator.extent.free_quanta -= ext->quanta;
+	pmem[id].allocator.extent.free_extents--;
+}
+
+static int pmem_free_extent(int id, int index)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct pmem_extent *ext, *curr, *prev = NULL, *next = NULL;
+	struct rb_node *node;
+	char currtask_name[FIELD_SIZEOF(struct task_struct, comm) + 1];
+
+	DLOG("index %d\n", index);
+
+	ext = pmem_extent_find(&pmem[id].allocator.extent.allocated, index);
+	if (!ext) {
+		printk(KERN_ALERT "pmem: %s: Attempt to free unallocated "
+			"index %d, id %d, pid %d(%s)\n", __func__, index, id,
+			current->pid, get_task_comm(currtask_name, current));
+		return -1;
+	}
+	rb_erase(&ext->addr_node, &pmem[id].allocator.extent.allocated);
+	pmem[id].allocator.extent.allocations--;
+
+	/* find the free extents on either side and coalesce with them */
+	node = pmem[id].allocator.extent.free_by_addr.rb_node;
+	while (node) {
+		curr = rb_entry(node, struct pmem_extent, addr_node);
+		if (curr->start < ext->start) {
+			prev = curr;
+			node = node->rb_right;
+		} else {
+			next = curr;
+			node = node->rb_left;
+		}
+	}
+
+	if (prev && prev->start + prev->quanta == ext->start) {
+		pmem_extent_erase_free(id, prev);
+		prev->quanta += ext->quanta;
+		kfree(ext);
+		ext = prev;
+	}
+	if (next && ext->start + ext->quanta == next->start) {
+		pmem_extent_erase_free(id, next);
+		ext->quanta += next->quanta;
+		kfree(next);
+	}
+	pmem_extent_insert_free(id, ext);
+
+	return 0;
+}
+
+static int pmem_free_space_extent(int id, struct pmem_freespace *fs)
+{
+	/* caller should hold the lock on arena_mutex! */
+	fs->total = pmem[id].allocator.extent.free_quanta * pmem[id].quantum;
+	fs->largest = pmem_extent_largest(id) * pmem[id].quantum;
+
+	return 0;
+}
+
+static void pmem_extent_destroy(int id)
+{
+	struct rb_root *roots[] = {
+		&pmem[id].allocator.extent.free_by_addr,
+		&pmem[id].allocator.extent.allocated,
+	};
+	struct rb_node *node;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(roots); i++)
+		while ((node = rb_first(roots[i]))) {
+			rb_erase(node, roots[i]);
+			kfree(rb_entry(node, struct pmem_extent, addr_node));
+		}
+	pmem[id].allocator.extent.free_by_size = RB_ROOT;
+}
+
 static void pmem_revoke(struct file *file, struct pmem_data *data);
 
 static int pmem_release(struct inode *inode, struct file *file)
@@ -1425,6 +1662,88 @@ static int pmem_allocator_system(const int id,
 	return (int)list;
 }
 
+static int pmem_allocator_extent(const int id,
+		const unsigned long len,
+		const unsigned int align)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct pmem_extent *ext = NULL, *curr, *head = NULL, *tail = NULL;
+	unsigned long quanta_needed, pad = 0, paddr;
+	struct rb_node *node;
+
+	DLOG("extent id %d, len %ld, align %u\n", id, len, align);
+
+	quanta_needed = (len + pmem[id].quantum - 1) / pmem[id].quantum;
+	if (!quanta_needed ||
+	    quanta_needed > pmem[id].allocator.extent.free_quanta)
+		return -1;
+
+	/* the smallest free extent which is long enough... */
+	node = pmem[id].allocator.extent.free_by_size.rb_node;
+	while (node) {
+		curr = rb_entry(node, struct pmem_extent, size_node);
+		if (curr->quanta >= quanta_needed) {
+			ext = curr;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	/* ...and which still is once its start is aligned */
+	for (; ext; node = rb_next(&ext->size_node),
+	     ext = node ? rb_entry(node, struct pmem_extent, size_node) : NULL) {
+		paddr = pmem[id].base + ext->start * pmem[id].quantum;
+		pad = DIV_ROUND_UP(ALIGN(paddr, align) - paddr,
+				   pmem[id].quantum);
+		if (pad + quanta_needed <= ext->quanta)
+			break;
+	}
+	if (!ext) {
+#if PMEM_DEBUG
+		printk(KERN_ALERT "pmem: %s: no free extent of %lu quanta "
+			"in id %d. Region memory is either too fragmented or"
+			" request is too large for available memory.\n",
+			__func__, quanta_needed, id);
+#endif
+		return -1;
+	}
+
+	/* whatever is left on either side goes back to the free trees */
+	if (pad) {
+		head = kmalloc(sizeof(struct pmem_extent), GFP_KERNEL);
+		if (!head)
+			return -1;
+	}
+	if (ext->quanta > pad + quanta_needed) {
+		tail = kmalloc(sizeof(struct pmem_extent), GFP_KERNEL);
+		if (!tail) {
+			kfree(head);
+			return -1;
+		}
+	}
+
+	pmem_extent_erase_free(id, ext);
+	if (head) {
+		head->start = ext->start;
+		head->quanta = pad;
+		pmem_extent_insert_free(id, head);
+	}
+	if (tail) {
+		tail->start = ext->start + pad + quanta_needed;
+		tail->quanta = ext->quanta - pad - quanta_needed;
+		pmem_extent_insert_free(id, tail);
+	}
+
+	ext->start += pad;
+	ext->quanta = quanta_needed;
+	pmem_extent_insert_addr(&pmem[id].allocator.extent.allocated, ext);
+	pmem[id].allocator.extent.allocations++;
+
+	DLOG("start %lu, quanta %lu\n", ext->start, ext->quanta);
+	return ext->start;
+}
+
 static pgprot_t pmem_phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -1463,6 +1782,11 @@ static unsigned long pmem_start_addr_bitmap(int id, struct pmem_data *data)
 	return data->index * pmem[id].quantum + pmem[id].base;
 }
 
+static unsigned long pmem_start_addr_extent(int id, struct pmem_data *data)
+{
+	return data->index * pmem[id].quantum + pmem[id].base;
+}
+
 static unsigned long pmem_start_addr_system(int id, struct pmem_data *data)
 {
 	return (unsigned long)(((struct alloc_list *)(data->index))->aaddr);
@@ -1510,6 +1834,25 @@ static unsigned long pmem_len_bitmap(int id, struct pmem_data *data)
 	return ret;
 }
 
+static unsigned long pmem_len_extent(int id, struct pmem_data *data)
+{
+	struct pmem_extent *ext;
+	unsigned long ret = 0;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ext = pmem_extent_find(&pmem[id].allocator.extent.allocated,
+			       data->index);
+	if (ext)
+		ret = ext->quanta * pmem[id].quantum;
+	mutex_unlock(&pmem[id].arena_mutex);
+#if PMEM_DEBUG
+	if (!ext)
+		pr_alert("pmem: %s: can't find extent %d in "
+			"allocated tree!\n", __func__, data->index);
+#endif
+	return ret;
+}
+
 static unsigned long pmem_len_system(int id, struct pmem_data *data)
 {
 	unsigned long ret = 0;
@@ -2567,9 +2910,12 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 			if (alloc.align != SZ_4K &&
 					(pmem[id].allocator_type !=
-						PMEM_ALLOCATORTYPE_BITMAP)) {
+						PMEM_ALLOCATORTYPE_BITMAP) &&
+					(pmem[id].allocator_type !=
+						PMEM_ALLOCATORTYPE_EXTENT)) {
 				pr_err("pmem: Non 4k alignment requires bitmap"
-					" allocator on %s\n", pmem[id].name);
+					" or extent allocator on %s\n",
+					pmem[id].name);
 				return -EINVAL;
 			}
 
@@ -2823,6 +3169,45 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 			pmem[id].size, pmem[id].quantum);
 		break;
 
+	case PMEM_ALLOCATORTYPE_EXTENT: {
+		struct pmem_extent *ext;
+
+		pmem[id].allocator.extent.free_by_size = RB_ROOT;
+		pmem[id].allocator.extent.free_by_addr = RB_ROOT;
+		pmem[id].allocator.extent.allocated = RB_ROOT;
+		pmem[id].allocator.extent.free_quanta = 0;
+		pmem[id].allocator.extent.free_extents = 0;
+		pmem[id].allocator.extent.allocations = 0;
+
+		ext = kzalloc(sizeof(struct pmem_extent), GFP_KERNEL);
+		if (!ext) {
+			pr_alert("pmem: %s: Unable to register pmem "
+					"driver %s - can't allocate extent!\n",
+					__func__, pdata->name);
+			goto err_reset_pmem_info;
+		}
+		ext->start = 0;
+		ext->quanta = pmem[id].num_entries;
+		pmem_extent_insert_free(id, ext);
+
+		if (kobject_init_and_add(&pmem[id].kobj,
+				&pmem_extent_ktype, NULL,
+				"%s", pdata->name))
+			goto out_put_kobj;
+
+		pmem[id].allocate = pmem_allocator_extent;
+		pmem[id].free = pmem_free_extent;
+		pmem[id].free_space = pmem_free_space_extent;
+		pmem[id].len = pmem_len_extent;
+		pmem[id].start_addr = pmem_start_addr_extent;
+
+		DLOG("extent allocator id %d (%s), num_entries %lu, raw size "
+			"%lu, quanta size %u\n",
+			id, pdata->name, pmem[id].num_entries,
+			pmem[id].size, pmem[id].quantum);
+		break;
+	}
+
 	case PMEM_ALLOCATORTYPE_SYSTEM:
 
 		INIT_LIST_HEAD(&pmem[id].allocator.system_mem.alist);
@@ -2936,7 +3321,8 @@ out_put_kobj:
 	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP) {
 		kfree(pmem[id].allocator.bitmap.bitmap);
 		kfree(pmem[id].allocator.bitmap.bitm_alloc);
-	}
+	} else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_EXTENT)
+		pmem_extent_destroy(id);
 err_reset_pmem_info:
 	pmem[id].allocate = 0;
 	pmem[id].dev.minor = -1;
@@ -2977,7 +3363,8 @@ static int pmem_remove(struct platform_device *pdev)
 	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP) {
 		kfree(pmem[id].allocator.bitmap.bitmap);
 		kfree(pmem[id].allocator.bitmap.bitm_alloc);
-	}
+	} else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_EXTENT)
+		pmem_extent_destroy(id);
 	misc_deregister(&pmem[id].dev);
 	return 0;
 }
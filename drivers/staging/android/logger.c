@@ -25,6 +25,14 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#endif
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,36 +41,83 @@
 #define CONFIG_LOGCAT_SIZE 256
 #endif
 
+/* payloads up to this size are staged on the writer's stack */
+#define LOGGER_STACK_PAYLOAD	256
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+/* raw bytes of entries sealed into each compressed chunk */
+#define LOGGER_CHUNK_SIZE	(16 * 1024)
+
+/*
+ * Only a quarter of each log stays a plain ring, the rest of its memory
+ * holds compressed history. The ring must leave the sealing work some
+ * slack, so logs too small for that keep a plain ring.
+ */
+#define LOGGER_SPLIT_MIN	(16 * LOGGER_CHUNK_SIZE)
+#define LOGGER_RING_SIZE(size) \
+	((size) >= LOGGER_SPLIT_MIN ? (size) / 4 : (size))
+#define LOGGER_ARCHIVE_INIT(size) \
+	.archive_size = (size) - LOGGER_RING_SIZE(size),
+
+struct logger_archive;
+#else
+#define LOGGER_RING_SIZE(size)		(size)
+#define LOGGER_ARCHIVE_INIT(size)
+#endif
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never take a lock. Positions in the log are free-running byte
+ * counts which are reduced with logger_offset() to index the buffer. A
+ * writer claims space by advancing 'w_resv', fills it in, then publishes it
+ * by advancing 'w_off' once every earlier claim has been published, so
+ * everything in [head, w_off) is a complete entry. Space is reclaimed by
+ * moving 'head' past the oldest entries before they are overwritten.
+ *
+ * Later writers spin on an unpublished claim, so a writer holds one only
+ * with preemption disabled and never faults or sleeps while holding it.
+ *
+ * The mutex 'mutex' only protects the list of readers and 'start'.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting readers and start */
+	atomic_long_t		w_resv;	/* end of the space claimed by writers */
+	atomic_long_t		w_off;	/* end of the last published entry */
+	atomic_long_t		head;	/* oldest entry not yet reclaimed */
+	size_t			start;	/* new readers start here */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct logger_archive	*archive; /* compressed history, if any */
+	size_t			archive_size; /* memory for compressed history */
+#endif
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by its mutex 'mutex'.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* mutex protecting r_off and r_ver */
+	size_t			r_off;	/* current read head position */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	unsigned char		*chunk;	/* decompressed copy of a sealed chunk */
+	size_t			chunk_start; /* positions held in 'chunk' */
+	size_t			chunk_end;
+#endif
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -71,6 +126,15 @@ size_t logger_offset(struct logger_log *log, size_t n)
 	return n & (log->size-1);
 }
 
+/*
+ * logger_pos_diff - returns how far position 'a' is ahead of position 'b',
+ * accounting for wrapping of the free-running positions
+ */
+static inline long logger_pos_diff(size_t a, size_t b)
+{
+	return (long)(a - b);
+}
+
 
 /*
  * file_get_log - Given a file structure, return the associated log
@@ -96,43 +160,46 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * logger_copy_out - copies 'count' bytes of 'log' starting at position 'pos'
+ * into 'buf', which may span the end and beginning of the circular buffer.
+ *
+ * A writer may be reclaiming the bytes concurrently, so callers must check
+ * log->head afterwards before trusting the copy.
  */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
+static void logger_copy_out(struct logger_log *log, size_t pos,
+			    void *buf, size_t count)
 {
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
-		return scratch;
-	}
+	size_t off = logger_offset(log, pos);
+	size_t len = min(count, log->size - off);
 
-	return (struct logger_entry *) (log->buffer + off);
+	memcpy(buf, log->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
+ * get_entry_header - copies the logger_entry header within 'log' starting
+ * at position 'pos' into 'entry'.
+ */
+static void get_entry_header(struct logger_log *log, size_t pos,
+			     struct logger_entry *entry)
+{
+	logger_copy_out(log, pos, entry, sizeof(struct logger_entry));
+}
+
+/*
+ * get_entry_len - Grabs the length of the entry starting from 'pos',
+ * including the log entry structure.
  *
  * An entry length is 2 bytes (16 bits) in host endian order.
  * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
- *
- * Caller needs to hold log->mutex.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static size_t get_entry_len(struct logger_log *log, size_t pos)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct logger_entry entry;
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	get_entry_header(log, pos, &entry);
+	return sizeof(struct logger_entry) + entry.len;
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -168,18 +235,527 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * logger_reader_lapped - has a writer reclaimed the entry at 'pos'?
+ *
+ * Writers move log->head past an entry before they overwrite any of it, so
+ * checking head after reading an entry tells whether the copy is intact.
+ */
+static inline bool logger_reader_lapped(struct logger_log *log, size_t pos)
+{
+	smp_rmb();
+	return logger_pos_diff(pos, atomic_long_read(&log->head)) < 0;
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+
+/*
+ * struct logger_chunk - a sealed, compressed run of whole entries
+ *
+ * Entries keep the layout they had in the ring, so 'start' and 'end' are
+ * positions in the log just like reader->r_off.
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_archive's chunks */
+	size_t			start;	/* position of the first entry */
+	size_t			end;	/* position just past the last entry */
+	size_t			len;	/* compressed length of 'data' */
+	unsigned char		data[0];
+};
+
+/*
+ * struct logger_archive - compressed history behind a log's ring
+ *
+ * Entries are sealed into chunks by 'seal_work' while they are still in
+ * the ring, and the oldest chunks are dropped once more than 'budget' bytes
+ * of compressed data are held. Everything but the staging buffers, which
+ * only 'seal_work' touches, is protected by 'mutex'.
+ */
+struct logger_archive {
+	struct logger_log	*log;	/* log this archive belongs to */
+	struct mutex		mutex;	/* mutex protecting the archive */
+	struct list_head	chunks;	/* sealed chunks, oldest first */
+	unsigned int		nr_chunks; /* number of sealed chunks */
+	size_t			sealed;	/* entries before this are sealed */
+	size_t			bytes;	/* compressed bytes held */
+	size_t			raw_bytes; /* raw bytes held */
+	size_t			budget;	/* most compressed bytes to hold */
+	struct work_struct	seal_work; /* seals full chunks */
+	unsigned char		*raw;	/* staging buffer for a chunk */
+	unsigned char		*dst;	/* staging buffer for compression */
+	void			*wrkmem; /* lz4 working memory */
+	u64			sealed_raw; /* raw bytes ever sealed */
+	u64			sealed_bytes; /* compressed bytes ever sealed */
+	u64			dropped; /* bytes lapped before being sealed */
+	unsigned long		loads;	/* chunks decompressed for readers */
+	u64			load_ns; /* time spent decompressing */
+	atomic_long_t		reads;	/* entries read from chunks */
+};
+
+static struct dentry *logger_debugfs_root;
+
+/*
+ * logger_reader_in_chunk - is the reader's position held in its
+ * decompressed chunk?
+ */
+static inline bool logger_reader_in_chunk(struct logger_reader *reader)
+{
+	return reader->r_off - reader->chunk_start <
+		reader->chunk_end - reader->chunk_start;
+}
+
+static inline void logger_chunk_header(struct logger_reader *reader,
+				       struct logger_entry *entry)
+{
+	memcpy(entry, reader->chunk + (reader->r_off - reader->chunk_start),
+	       sizeof(struct logger_entry));
+}
+
+static unsigned long logger_chunk_copy_to_user(struct logger_log *log,
+					       struct logger_reader *reader,
+					       char __user *buf, size_t count)
+{
+	size_t off = reader->r_off - reader->chunk_start +
+		sizeof(struct logger_entry);
+
+	atomic_long_inc(&log->archive->reads);
+	return copy_to_user(buf, reader->chunk + off, count);
+}
+
+/*
+ * logger_archive_find - returns the chunk holding position 'pos', or the
+ * first one after it, or NULL if nothing at or after 'pos' is sealed.
  *
- * Caller must hold log->mutex.
+ * Caller must hold archive->mutex.
+ */
+static struct logger_chunk *logger_archive_find(struct logger_archive *archive,
+						size_t pos)
+{
+	struct logger_chunk *chunk;
+
+	list_for_each_entry(chunk, &archive->chunks, list)
+		if (logger_pos_diff(chunk->end, pos) > 0)
+			return chunk;
+	return NULL;
+}
+
+/*
+ * logger_archive_load - decompresses the chunk a lapped reader has to
+ * continue from into reader->chunk, moving the reader to its start if the
+ * reader was lapped by the archive too. Returns false if nothing the reader
+ * still needs is sealed, or it is all still in the ring anyway.
+ *
+ * Caller must hold reader->mutex.
+ */
+static bool logger_archive_load(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	struct logger_archive *archive = log->archive;
+	struct logger_chunk *chunk;
+	size_t len;
+	ktime_t start;
+	bool ret = false;
+
+	if (!archive)
+		return false;
+
+	if (!reader->chunk) {
+		reader->chunk = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		if (!reader->chunk)
+			return false;
+	}
+
+	mutex_lock(&archive->mutex);
+	chunk = logger_archive_find(archive, reader->r_off);
+	if (!chunk || logger_pos_diff(chunk->start,
+				      atomic_long_read(&log->head)) >= 0)
+		goto out;
+
+	start = ktime_get();
+	len = chunk->len;
+	if (lz4_decompress(chunk->data, &len, reader->chunk,
+			   chunk->end - chunk->start) < 0) {
+		printk(KERN_ERR "logger: corrupt chunk in log '%s'\n",
+		       log->misc.name);
+		goto out;
+	}
+	archive->load_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	archive->loads++;
+
+	if (logger_pos_diff(reader->r_off, chunk->start) < 0)
+		reader->r_off = chunk->start;
+	reader->chunk_start = chunk->start;
+	reader->chunk_end = chunk->end;
+	ret = true;
+out:
+	mutex_unlock(&archive->mutex);
+	return ret;
+}
+
+/*
+ * logger_archive_oldest - returns the first position at or after 'pos'
+ * which is still held by 'log', given that 'pos' is no longer in the ring.
+ */
+static size_t logger_archive_oldest(struct logger_log *log, size_t pos)
+{
+	struct logger_archive *archive = log->archive;
+	struct logger_chunk *chunk;
+	size_t head = atomic_long_read(&log->head);
+
+	if (!archive)
+		return head;
+
+	mutex_lock(&archive->mutex);
+	chunk = logger_archive_find(archive, pos);
+	if (chunk && logger_pos_diff(chunk->start, head) < 0)
+		head = logger_pos_diff(pos, chunk->start) > 0 ? pos : chunk->start;
+	mutex_unlock(&archive->mutex);
+
+	return head;
+}
+
+/*
+ * logger_archive_drop - account for entries lapped before they were sealed
+ *
+ * Caller must hold archive->mutex.
+ */
+static void logger_archive_drop(struct logger_archive *archive, size_t pos)
+{
+	archive->dropped += pos - archive->sealed;
+	archive->sealed = pos;
+}
+
+/*
+ * logger_seal_work - compress the full chunks of entries which have been
+ * published since the last run and append them to the archive
+ */
+static void logger_seal_work(struct work_struct *work)
+{
+	struct logger_archive *archive = container_of(work,
+					struct logger_archive, seal_work);
+	struct logger_log *log = archive->log;
+	struct logger_chunk *chunk;
+	size_t pos, end, len;
+
+	for (;;) {
+		mutex_lock(&archive->mutex);
+		pos = archive->sealed;
+		if (logger_reader_lapped(log, pos)) {
+			logger_archive_drop(archive,
+					    atomic_long_read(&log->head));
+			mutex_unlock(&archive->mutex);
+			continue;
+		}
+		mutex_unlock(&archive->mutex);
+
+		/* gather whole entries until the next one does not fit */
+		end = pos;
+		for (;;) {
+			if (end == (size_t) atomic_long_read(&log->w_off))
+				return;
+
+			/* pairs with the smp_wmb() in logger_commit() */
+			smp_rmb();
+			len = get_entry_len(log, end);
+			if (end - pos + len > LOGGER_CHUNK_SIZE)
+				break;
+			end += len;
+		}
+
+		logger_copy_out(log, pos, archive->raw, end - pos);
+		if (logger_reader_lapped(log, pos))
+			continue;
+
+		chunk = NULL;
+		if (!lz4_compress(archive->raw, end - pos, archive->dst, &len,
+				  archive->wrkmem))
+			chunk = kmalloc(sizeof(struct logger_chunk) + len,
+					GFP_KERNEL);
+
+		mutex_lock(&archive->mutex);
+		if (archive->sealed != pos) {
+			/* the log was flushed under us */
+			kfree(chunk);
+		} else if (!chunk) {
+			logger_archive_drop(archive, end);
+		} else {
+			memcpy(chunk->data, archive->dst, len);
+			chunk->start = pos;
+			chunk->end = end;
+			chunk->len = len;
+			list_add_tail(&chunk->list, &archive->chunks);
+			archive->nr_chunks++;
+			archive->bytes += len;
+			archive->raw_bytes += end - pos;
+			archive->sealed_raw += end - pos;
+			archive->sealed_bytes += len;
+			archive->sealed = end;
+
+			while (archive->bytes > archive->budget) {
+				chunk = list_first_entry(&archive->chunks,
+						struct logger_chunk, list);
+				list_del(&chunk->list);
+				archive->nr_chunks--;
+				archive->bytes -= chunk->len;
+				archive->raw_bytes -= chunk->end - chunk->start;
+				kfree(chunk);
+			}
+		}
+		mutex_unlock(&archive->mutex);
+	}
+}
+
+/*
+ * logger_archive_kick - called by a writer after publishing the entry of
+ * 'len' bytes at 'pos'; kicks the sealing work about once per chunk
+ */
+static inline void logger_archive_kick(struct logger_log *log,
+				       size_t pos, size_t len)
+{
+	if (log->archive &&
+	    ((pos ^ (pos + len)) & ~(size_t)(LOGGER_CHUNK_SIZE - 1)))
+		queue_work(system_nrt_wq, &log->archive->seal_work);
+}
+
+/* logger_archive_flush - drop all compressed history up to 'pos' */
+static void logger_archive_flush(struct logger_log *log, size_t pos)
+{
+	struct logger_archive *archive = log->archive;
+	struct logger_chunk *chunk, *tmp;
+
+	if (!archive)
+		return;
+
+	mutex_lock(&archive->mutex);
+	list_for_each_entry_safe(chunk, tmp, &archive->chunks, list) {
+		list_del(&chunk->list);
+		kfree(chunk);
+	}
+	archive->nr_chunks = 0;
+	archive->bytes = 0;
+	archive->raw_bytes = 0;
+	archive->sealed = pos;
+	mutex_unlock(&archive->mutex);
+}
+
+static void logger_reader_init_chunk(struct logger_reader *reader)
+{
+	reader->chunk = NULL;
+	reader->chunk_start = 0;
+	reader->chunk_end = 0;
+}
+
+static void logger_reader_free_chunk(struct logger_reader *reader)
+{
+	kfree(reader->chunk);
+}
+
+static int logger_archive_show(struct seq_file *m, void *unused)
+{
+	struct logger_log *log = m->private;
+	struct logger_archive *archive = log->archive;
+	unsigned long reads = atomic_long_read(&archive->reads);
+	u64 ratio, per_load, per_read;
+
+	mutex_lock(&archive->mutex);
+
+	ratio = archive->sealed_raw * 100;
+	if (archive->sealed_bytes)
+		do_div(ratio, archive->sealed_bytes);
+	else
+		ratio = 0;
+	per_load = archive->load_ns;
+	if (archive->loads)
+		do_div(per_load, archive->loads);
+	per_read = archive->load_ns;
+	if (reads)
+		do_div(per_read, reads);
+
+	seq_printf(m, "ring: %zu bytes\n", log->size);
+	seq_printf(m, "archive: %u chunks, %zu raw bytes in %zu of %zu bytes\n",
+		   archive->nr_chunks, archive->raw_bytes, archive->bytes,
+		   archive->budget);
+	seq_printf(m, "sealed: %llu raw bytes in %llu bytes, ratio %llu.%02llu\n",
+		   archive->sealed_raw, archive->sealed_bytes,
+		   ratio / 100, ratio % 100);
+	seq_printf(m, "dropped: %llu bytes\n", archive->dropped);
+	seq_printf(m, "decompressed: %lu chunks, %llu ns per chunk\n",
+		   archive->loads, per_load);
+	seq_printf(m, "read: %lu entries, %llu ns decompression per entry\n",
+		   reads, per_read);
+
+	mutex_unlock(&archive->mutex);
+	return 0;
+}
+
+static int logger_archive_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, logger_archive_show, inode->i_private);
+}
+
+static const struct file_operations logger_archive_fops = {
+	.owner = THIS_MODULE,
+	.open = logger_archive_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * logger_archive_init - set up compressed history for 'log' if it has
+ * memory set aside for it. A log which fails this keeps a plain ring.
+ */
+static void __init logger_archive_init(struct logger_log *log)
+{
+	struct logger_archive *archive;
+
+	if (!log->archive_size)
+		return;
+
+	archive = kzalloc(sizeof(struct logger_archive), GFP_KERNEL);
+	if (!archive)
+		goto err;
+	archive->raw = vmalloc(LOGGER_CHUNK_SIZE);
+	archive->dst = vmalloc(lz4_compressbound(LOGGER_CHUNK_SIZE));
+	archive->wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	if (!archive->raw || !archive->dst || !archive->wrkmem)
+		goto err_free;
+
+	archive->log = log;
+	mutex_init(&archive->mutex);
+	INIT_LIST_HEAD(&archive->chunks);
+	INIT_WORK(&archive->seal_work, logger_seal_work);
+	atomic_long_set(&archive->reads, 0);
+	archive->budget = log->archive_size;
+	log->archive = archive;
+
+	if (!logger_debugfs_root)
+		logger_debugfs_root = debugfs_create_dir("logger", NULL);
+	if (logger_debugfs_root)
+		debugfs_create_file(log->misc.name, S_IRUGO,
+				    logger_debugfs_root, log,
+				    &logger_archive_fops);
+	return;
+
+err_free:
+	vfree(archive->wrkmem);
+	vfree(archive->dst);
+	vfree(archive->raw);
+	kfree(archive);
+err:
+	printk(KERN_ERR "logger: no compressed history for log '%s'\n",
+	       log->misc.name);
+}
+
+#else
+
+static inline bool logger_reader_in_chunk(struct logger_reader *reader)
+{
+	return false;
+}
+
+static inline void logger_chunk_header(struct logger_reader *reader,
+				       struct logger_entry *entry)
+{
+}
+
+static inline unsigned long logger_chunk_copy_to_user(struct logger_log *log,
+		struct logger_reader *reader, char __user *buf, size_t count)
+{
+	return count;
+}
+
+static inline bool logger_archive_load(struct logger_log *log,
+				       struct logger_reader *reader)
+{
+	return false;
+}
+
+static inline size_t logger_archive_oldest(struct logger_log *log, size_t pos)
+{
+	return atomic_long_read(&log->head);
+}
+
+static inline void logger_archive_kick(struct logger_log *log,
+				       size_t pos, size_t len)
+{
+}
+
+static inline void logger_archive_flush(struct logger_log *log, size_t pos)
+{
+}
+
+static inline void logger_reader_init_chunk(struct logger_reader *reader)
+{
+}
+
+static inline void logger_reader_free_chunk(struct logger_reader *reader)
+{
+}
+
+static inline void logger_archive_init(struct logger_log *log)
+{
+}
+
+#endif /* CONFIG_ANDROID_LOGGER_COMPRESS */
+
+/*
+ * logger_next_entry - moves 'reader' to the next entry it is allowed to see
+ * and copies that entry's header into 'entry'. Returns false if the reader
+ * has caught up with the writers.
+ *
+ * A reader lapped by the writers continues from the compressed history, if
+ * the log keeps any.
+ *
+ * Caller must hold reader->mutex.
+ */
+static bool logger_next_entry(struct logger_log *log,
+			      struct logger_reader *reader,
+			      struct logger_entry *entry)
+{
+	uid_t euid = current_euid();
+
+	for (;;) {
+		/* pull the reader forward if it was lapped by the writers */
+		if (!logger_reader_in_chunk(reader) &&
+		    logger_reader_lapped(log, reader->r_off) &&
+		    !logger_archive_load(log, reader))
+			reader->r_off = atomic_long_read(&log->head);
+
+		if (logger_reader_in_chunk(reader)) {
+			logger_chunk_header(reader, entry);
+		} else {
+			if (reader->r_off ==
+			    (size_t) atomic_long_read(&log->w_off))
+				return false;
+
+			/* pairs with the smp_wmb() in logger_commit() */
+			smp_rmb();
+			get_entry_header(log, reader->r_off, entry);
+			if (logger_reader_lapped(log, reader->r_off))
+				continue;
+		}
+
+		if (reader->r_all || entry->euid == euid)
+			return true;
+
+		reader->r_off += sizeof(struct logger_entry) + entry->len;
+	}
+}
+
+/*
+ * do_read_log_to_user - reads the entry 'entry' at the reader's position in
+ * 'log' into the user-space buffer 'buf', which must hold 'count' bytes.
+ * Returns 'count' on success, or zero if a writer reclaimed the entry while
+ * it was being copied.
+ *
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
+				   struct logger_entry *entry,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
 	size_t len;
 	size_t msg_start;
 
@@ -187,12 +763,18 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
 	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
+
+	if (logger_reader_in_chunk(reader)) {
+		if (logger_chunk_copy_to_user(log, reader, buf, count))
+			return -EFAULT;
+		goto out;
+	}
+
 	msg_start = logger_offset(log,
 		reader->r_off + sizeof(struct logger_entry));
 
@@ -213,34 +795,13 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
-
-	return count + get_user_hdr_len(reader->r_ver);
-}
-
-/*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
- */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
-{
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
-
-		entry = get_entry_header(log, off, &scratch);
-
-		if (entry->euid == euid)
-			return off;
+	if (logger_reader_lapped(log, reader->r_off))
+		return 0;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
-	}
+out:
+	reader->r_off += sizeof(struct logger_entry) + count;
 
-	return off;
+	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
@@ -260,17 +821,18 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry entry;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
-		mutex_lock(&log->mutex);
+		mutex_lock(&reader->mutex);
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = ((size_t) atomic_long_read(&log->w_off) == reader->r_off);
+		mutex_unlock(&reader->mutex);
 		if (!ret)
 			break;
 
@@ -291,170 +853,120 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+	mutex_lock(&reader->mutex);
 
+retry:
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(!logger_next_entry(log, reader, &entry))) {
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, reader, &entry, buf, ret);
+	if (unlikely(!ret))
+		goto retry;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_make_room - reclaim the oldest entries until the entry ending at
+ * position 'end' can be written without overwriting any of them.
  *
- * Caller must hold log->mutex.
+ * Every writer reclaiming space races to advance log->head, one entry at a
+ * time, with cmpxchg; losing a race simply means someone else did the work.
+ * An entry is only reclaimed once it has been published, so this waits for
+ * a writer that claimed space a whole buffer ago and has not finished yet.
+ *
+ * Caller must have preemption disabled.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void logger_make_room(struct logger_log *log, size_t end)
 {
-	size_t count = 0;
+	size_t head;
+	size_t len;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
+	for (;;) {
+		head = atomic_long_read(&log->head);
+		if (logger_pos_diff(end, head) <= (long) log->size)
+			break;
 
-	return off;
-}
+		if (logger_pos_diff(atomic_long_read(&log->w_off), head) <= 0) {
+			cpu_relax();
+			continue;
+		}
 
-/*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
- *
- * |------- a xxxxxxxx b --------|
- *               c^
- *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
- */
-static inline int is_between(size_t a, size_t b, size_t c)
-{
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
+		/* pairs with the smp_wmb() in logger_commit() */
+		smp_rmb();
+		len = get_entry_len(log, head);
+		atomic_long_cmpxchg(&log->head, head, head + len);
 	}
-
-	return 0;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * logger_commit - publish the entry of 'len' bytes at position 'pos' to the
+ * readers. Entries are published in the order their space was claimed, so
+ * this waits for any writer that claimed space before us.
  *
- * The caller needs to hold log->mutex.
+ * Caller must have preemption disabled.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log, size_t pos, size_t len)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
-
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	while ((size_t) atomic_long_read(&log->w_off) != pos)
+		cpu_relax();
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	smp_wmb();
+	atomic_long_set(&log->w_off, pos + len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'pos'
  *
- * The caller needs to hold log->mutex.
+ * The caller must have claimed the space.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t pos,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(log, pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
-}
-
-/*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
- */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
-{
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
-			return -EFAULT;
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
-	return count;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * Writers on different CPUs copy their entries in parallel; they only
+ * serialize on publishing them, in the order they claimed space. The
+ * payload is copied from user-space before claiming space, so a fault
+ * never holds up the writers queued behind us.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	unsigned char stack_payload[LOGGER_STACK_PAYLOAD];
+	unsigned char *payload = stack_payload;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	size_t pos, off, len;
+	ssize_t ret;
 
 	now = current_kernel_time();
 
@@ -470,41 +982,46 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	if (header.len > sizeof(stack_payload)) {
+		payload = kmalloc(header.len, GFP_KERNEL);
+		if (!payload)
+			return -ENOMEM;
+	}
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	for (off = 0; nr_segs-- > 0 && off < header.len; iov++) {
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, header.len - off);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+		if (copy_from_user(payload + off, iov->iov_base, len)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		off += len;
+	}
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	/* claim our space, then make sure no reader can still see it */
+	len = sizeof(struct logger_entry) + header.len;
+	preempt_disable();
+	pos = atomic_long_add_return(len, &log->w_resv) - len;
+	logger_make_room(log, pos + len);
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	do_write_log(log, pos, &header, sizeof(struct logger_entry));
+	do_write_log(log, pos + sizeof(struct logger_entry), payload,
+		     header.len);
+	logger_commit(log, pos, len);
+	preempt_enable();
 
-		iov++;
-		ret += nr;
-	}
+	logger_archive_kick(log, pos, len);
 
-	mutex_unlock(&log->mutex);
+	/* wake up any blocked readers; pairs with prepare_to_wait() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	ret = header.len;
+out:
+	if (payload != stack_payload)
+		kfree(payload);
 
 	return ret;
 }
@@ -542,9 +1059,12 @@ static int logger_open(struct inode *inode, struct file *file)
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
+		mutex_init(&reader->mutex);
+		logger_reader_init_chunk(reader);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		/* logger_next_entry() pulls this forward if already lapped */
+		reader->r_off = log->start;
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -570,6 +1090,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 		list_del(&reader->list);
 		mutex_unlock(&log->mutex);
 
+		logger_reader_free_chunk(reader);
 		kfree(reader);
 	}
 
@@ -589,6 +1110,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry entry;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -599,14 +1121,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (logger_next_entry(log, reader, &entry))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -620,19 +1138,42 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	if ((version < 1) || (version > 2))
 		return -EINVAL;
 
+	mutex_lock(&reader->mutex);
 	reader->r_ver = version;
+	mutex_unlock(&reader->mutex);
 	return 0;
 }
 
+/*
+ * logger_flush - drop everything currently in 'log' for all of its readers,
+ * including the ones yet to come
+ */
+static void logger_flush(struct logger_log *log)
+{
+	struct logger_reader *reader;
+	size_t w_off;
+
+	mutex_lock(&log->mutex);
+	w_off = atomic_long_read(&log->w_off);
+	list_for_each_entry(reader, &log->readers, list) {
+		mutex_lock(&reader->mutex);
+		reader->r_off = w_off;
+		mutex_unlock(&reader->mutex);
+	}
+	log->start = w_off;
+	logger_archive_flush(log, w_off);
+	mutex_unlock(&log->mutex);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry entry;
+	size_t pos;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -643,10 +1184,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		pos = reader->r_off;
+		if (!logger_reader_in_chunk(reader) &&
+		    logger_reader_lapped(log, pos))
+			pos = logger_archive_oldest(log, pos);
+		ret = atomic_long_read(&log->w_off) - pos;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -655,15 +1199,12 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		mutex_lock(&reader->mutex);
+		if (logger_next_entry(log, reader, &entry))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
@@ -675,9 +1216,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EPERM;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		logger_flush(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -698,8 +1237,6 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
@@ -717,10 +1254,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)). With compressed
+ * history, only LOGGER_RING_SIZE(SIZE) of that is the ring itself.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[LOGGER_RING_SIZE(SIZE)]; \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -732,9 +1270,12 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
-	.size = SIZE, \
+	.w_resv = ATOMIC_LONG_INIT(0), \
+	.w_off = ATOMIC_LONG_INIT(0), \
+	.head = ATOMIC_LONG_INIT(0), \
+	.start = 0, \
+	.size = LOGGER_RING_SIZE(SIZE), \
+	LOGGER_ARCHIVE_INIT(SIZE) \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, CONFIG_LOGCAT_SIZE*1024)
@@ -759,6 +1300,8 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	logger_archive_init(log);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
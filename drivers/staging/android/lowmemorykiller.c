@@ -44,6 +44,9 @@
 #include <linux/delay.h>
 #include <linux/fs.h>
 #include <linux/vmpressure.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/almk.h>
@@ -187,23 +190,428 @@ static int test_task_flag(struct task_struct *p, int flag)
 	return 0;
 }
 
+/*
+ * The reaper tears down the anonymous memory of a killed task right away,
+ * rather than waiting for the task to reach exit_mmap() itself, which may
+ * take a long time if it is blocked in uninterruptible sleep.
+ */
+static int lowmem_oom_reaper = 1;
+module_param_named(oom_reaper, lowmem_oom_reaper, int, S_IRUGO | S_IWUSR);
+
+/* Per kill reaping stats */
+static unsigned long lowmem_reap_count;
+module_param_named(reap_count, lowmem_reap_count, ulong, S_IRUGO);
+static unsigned long lowmem_reap_failed;
+module_param_named(reap_failed, lowmem_reap_failed, ulong, S_IRUGO);
+static unsigned long lowmem_reap_pages;
+module_param_named(reap_pages, lowmem_reap_pages, ulong, S_IRUGO);
+static unsigned long lowmem_reap_time_total_us;
+module_param_named(reap_time_total_us, lowmem_reap_time_total_us, ulong,
+	S_IRUGO);
+static unsigned long lowmem_reap_time_max_us;
+module_param_named(reap_time_max_us, lowmem_reap_time_max_us, ulong,
+	S_IRUGO);
+
+#define LOWMEM_REAP_QUEUE_SIZE	8
+#define LOWMEM_REAP_RETRIES	10
+
+struct lowmem_reap_req {
+	struct task_struct *task;
+	ktime_t kill_time;
+};
+
+static struct lowmem_reap_req lowmem_reap_queue[LOWMEM_REAP_QUEUE_SIZE];
+static unsigned int lowmem_reap_head, lowmem_reap_tail;
+static DEFINE_SPINLOCK(lowmem_reap_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_reap_wait);
+static struct task_struct *lowmem_reap_thread;
+
+/* Hand a freshly killed task to the reaper; called under rcu_read_lock */
+static void lowmem_queue_reap(struct task_struct *tsk)
+{
+	struct lowmem_reap_req *req;
+
+	if (!lowmem_oom_reaper || !lowmem_reap_thread)
+		return;
+
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reap_head - lowmem_reap_tail >= LOWMEM_REAP_QUEUE_SIZE) {
+		/* the victim still frees its memory on exit */
+		spin_unlock(&lowmem_reap_lock);
+		return;
+	}
+	req = &lowmem_reap_queue[lowmem_reap_head % LOWMEM_REAP_QUEUE_SIZE];
+	get_task_struct(tsk);
+	req->task = tsk;
+	req->kill_time = ktime_get();
+	lowmem_reap_head++;
+	spin_unlock(&lowmem_reap_lock);
+
+	wake_up(&lowmem_reap_wait);
+}
+
+static bool lowmem_dequeue_reap(struct lowmem_reap_req *req)
+{
+	bool ret = false;
+
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reap_tail != lowmem_reap_head) {
+		*req = lowmem_reap_queue[lowmem_reap_tail %
+					 LOWMEM_REAP_QUEUE_SIZE];
+		lowmem_reap_tail++;
+		ret = true;
+	}
+	spin_unlock(&lowmem_reap_lock);
+
+	return ret;
+}
+
+/*
+ * Tearing down the address space is only safe if nobody outside the
+ * victim's thread group can still use it, e.g. after CLONE_VM. The
+ * group leader may already have dropped its mm, so every thread of a
+ * process is looked at until one still has one.
+ */
+static bool lowmem_mm_shared(struct task_struct *tsk, struct mm_struct *mm)
+{
+	struct task_struct *p, *t;
+	bool ret = false;
+
+	rcu_read_lock();
+	for_each_process(p) {
+		if (same_thread_group(p, tsk) || (p->flags & PF_KTHREAD))
+			continue;
+		for_each_thread(p, t) {
+			struct mm_struct *t_mm = ACCESS_ONCE(t->mm);
+
+			if (t_mm) {
+				ret = t_mm == mm;
+				break;
+			}
+		}
+		if (ret)
+			break;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Returns -EAGAIN if mmap_sem is contended and the caller should retry,
+ * otherwise the number of pages given back (or a negative error).
+ */
+static long lowmem_reap_task(struct task_struct *tsk)
+{
+	struct task_struct *p;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	unsigned long rss;
+	long ret;
+
+	/* the group leader may be gone while other threads still run */
+	p = find_lock_task_mm(tsk);
+	if (!p)
+		return 0;	/* all threads are past exit_mm() */
+	mm = p->mm;
+	atomic_inc(&mm->mm_users);
+	task_unlock(p);
+
+	if (lowmem_mm_shared(tsk, mm)) {
+		ret = -EBUSY;
+		goto out_put;
+	}
+
+	if (!down_read_trylock(&mm->mmap_sem)) {
+		ret = -EAGAIN;
+		goto out_put;
+	}
+
+	/*
+	 * The victim may still be running in the kernel, e.g. in the middle
+	 * of a write() from memory about to go. Once this is set, faults on
+	 * its private memory fail instead of bringing back zeroes, see
+	 * handle_mm_fault().
+	 */
+	set_bit(MMF_OOM_REAPED, &mm->flags);
+
+	rss = get_mm_rss(mm);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		/*
+		 * Only private memory is dropped: shared and file-backed
+		 * pages don't go away with the victim anyway, and mlocked,
+		 * hugetlb and pfn mappings need more care than we can
+		 * afford here.
+		 */
+		if (vma->vm_flags & (VM_SHARED | VM_LOCKED | VM_HUGETLB |
+				     VM_PFNMAP | VM_IO))
+			continue;
+		if (!vma->anon_vma)
+			continue;
+
+		zap_page_range(vma, vma->vm_start,
+			       vma->vm_end - vma->vm_start, NULL);
+	}
+	ret = rss - get_mm_rss(mm);
+	up_read(&mm->mmap_sem);
+out_put:
+	mmput(mm);
+
+	return ret;
+}
+
+static void lowmem_reap(struct lowmem_reap_req *req)
+{
+	struct task_struct *tsk = req->task;
+	int attempts = 0;
+	long ret;
+	u64 us;
+
+	do {
+		ret = lowmem_reap_task(tsk);
+		if (ret != -EAGAIN)
+			break;
+		schedule_timeout_interruptible(HZ / 10);
+	} while (++attempts < LOWMEM_REAP_RETRIES);
+
+	us = ktime_to_us(ktime_sub(ktime_get(), req->kill_time));
+	if (ret < 0) {
+		lowmem_reap_failed++;
+		lowmem_print(2, "failed to reap '%s' (%d): %ld\n",
+			     tsk->comm, tsk->pid, ret);
+	} else {
+		lowmem_reap_count++;
+		lowmem_reap_pages += ret;
+		lowmem_reap_time_total_us += us;
+		if (us > lowmem_reap_time_max_us)
+			lowmem_reap_time_max_us = us;
+		lowmem_print(2, "reaped '%s' (%d), %ldkB in %lluus\n",
+			     tsk->comm, tsk->pid,
+			     ret * (long)(PAGE_SIZE / 1024), us);
+		trace_almk_reap(tsk->pid, ret, attempts + 1, us);
+	}
+	put_task_struct(tsk);
+}
+
+static int lowmem_reaper(void *unused)
+{
+	struct lowmem_reap_req req;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_reap_wait,
+			lowmem_reap_head != lowmem_reap_tail ||
+			kthread_should_stop());
+
+		while (lowmem_dequeue_reap(&req))
+			lowmem_reap(&req);
+	}
+
+	/* drop whatever was queued after the last pass */
+	while (lowmem_dequeue_reap(&req))
+		put_task_struct(req.task);
+
+	return 0;
+}
+
+/*
+ * A victim whose memory has been reaped no longer holds up further kills,
+ * and is not worth killing again.
+ */
+static bool lowmem_task_reaped(struct task_struct *tsk)
+{
+	struct task_struct *p;
+	bool ret;
+
+	p = find_lock_task_mm(tsk);
+	if (!p)
+		return false;
+	ret = test_bit(MMF_OOM_REAPED, &p->mm->flags);
+	task_unlock(p);
+
+	return ret;
+}
+
+struct lowmem_victim {
+	struct task_struct *task;
+	int tasksize;
+	short oom_score_adj;
+};
+
+/*
+ * Check whether @tsk is a better victim than the one picked so far, and
+ * if so hold a reference to it in @victim. Returns -EBUSY if a previous
+ * victim is still dying, in which case the caller should give it time
+ * instead of killing something else.
+ */
+static int lowmem_consider(struct task_struct *tsk, short min_score_adj,
+			   struct lowmem_victim *victim)
+{
+	struct task_struct *p;
+	short oom_score_adj;
+	int tasksize;
+
+	if (tsk->flags & PF_KTHREAD)
+		return 0;
+
+	if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		if (test_task_flag(tsk, TIF_MEMDIE) &&
+		    !lowmem_task_reaped(tsk))
+			return -EBUSY;
+	}
+
+	p = find_lock_task_mm(tsk);
+	if (!p)
+		return 0;
+
+	if (test_bit(MMF_OOM_REAPED, &p->mm->flags)) {
+		task_unlock(p);
+		return 0;
+	}
+
+	oom_score_adj = p->signal->oom_score_adj;
+	if (oom_score_adj < min_score_adj) {
+		task_unlock(p);
+		return 0;
+	}
+	tasksize = get_mm_rss(p->mm);
+	task_unlock(p);
+	if (tasksize <= 0)
+		return 0;
+	if (victim->task) {
+		if (oom_score_adj < victim->oom_score_adj)
+			return 0;
+		if (oom_score_adj == victim->oom_score_adj &&
+		    tasksize <= victim->tasksize)
+			return 0;
+	}
+	if (victim->task)
+		put_task_struct(victim->task);
+	get_task_struct(p);
+	victim->task = p;
+	victim->tasksize = tasksize;
+	victim->oom_score_adj = oom_score_adj;
+	lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
+		     p->comm, p->pid, oom_score_adj, tasksize);
+
+	return 0;
+}
+
+#ifdef CONFIG_ANDROID_LMK_ADJ_INDEX
+/* tasks taken off a bucket per hold of oom_adj_index_lock */
+#define LOWMEM_SCAN_BATCH	16
+
+static bool lowmem_index_head(struct list_head *pos)
+{
+	return pos >= &oom_adj_index[0] &&
+	       pos < &oom_adj_index[OOM_ADJ_INDEX_BUCKETS];
+}
+
+/*
+ * Gather up to LOWMEM_SCAN_BATCH tasks of a bucket into @batch, holding a
+ * reference to each, starting after @cursor or at @head if there is no
+ * cursor or it has left the index. If the cursor has moved to another
+ * bucket, this stops at the end of that one instead.
+ */
+static int lowmem_gather(struct list_head *head, struct task_struct *cursor,
+			 struct task_struct **batch)
+{
+	struct list_head *pos = head;
+	unsigned long flags;
+	int n = 0;
+
+	spin_lock_irqsave(&oom_adj_index_lock, flags);
+	if (cursor && !list_empty(&cursor->adj_node))
+		pos = &cursor->adj_node;
+	for (pos = pos->next; !lowmem_index_head(pos) && n < LOWMEM_SCAN_BATCH;
+	     pos = pos->next) {
+		batch[n] = list_entry(pos, struct task_struct, adj_node);
+		get_task_struct(batch[n++]);
+	}
+	spin_unlock_irqrestore(&oom_adj_index_lock, flags);
+
+	return n;
+}
+
+/*
+ * Walk the oom_score_adj buckets from the top and stop at the first one
+ * that yields a victim, as nothing in a lower bucket can beat it. A
+ * previous victim that is still dying in a lower bucket is not waited
+ * for: the task found has a higher oom_score_adj and would be next anyway.
+ *
+ * oom_adj_index_lock is taken with interrupts off, so only a batch of
+ * tasks is pulled off the index at a time and they are looked at after
+ * dropping it. The last task of a full batch stays pinned to resume from.
+ */
+static int lowmem_select(short min_score_adj, struct lowmem_victim *victim,
+			 int *nr_scanned)
+{
+	struct task_struct *batch[LOWMEM_SCAN_BATCH];
+	struct task_struct *cursor;
+	int adj, i, n;
+	int ret = 0;
+
+	for (adj = OOM_SCORE_ADJ_MAX;
+	     adj >= max_t(int, min_score_adj, OOM_SCORE_ADJ_MIN); adj--) {
+		cursor = NULL;
+		do {
+			n = lowmem_gather(oom_adj_index_bucket(adj), cursor,
+					  batch);
+			if (cursor)
+				put_task_struct(cursor);
+			cursor = NULL;
+
+			for (i = 0; i < n && !ret; i++) {
+				(*nr_scanned)++;
+				ret = lowmem_consider(batch[i], min_score_adj,
+						      victim);
+			}
+
+			if (n == LOWMEM_SCAN_BATCH && !ret)
+				cursor = batch[--n];
+			for (i = 0; i < n; i++)
+				put_task_struct(batch[i]);
+		} while (cursor);
+
+		if (ret || victim->task)
+			break;
+	}
+
+	return ret;
+}
+#else
+static int lowmem_select(short min_score_adj, struct lowmem_victim *victim,
+			 int *nr_scanned)
+{
+	struct task_struct *tsk;
+	int ret;
+
+	for_each_process(tsk) {
+		(*nr_scanned)++;
+		ret = lowmem_consider(tsk, min_score_adj, victim);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+#endif
+
 static DEFINE_MUTEX(scan_mutex);
 
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
+	struct lowmem_victim victim = { .task = NULL };
+	struct task_struct *selected;
 	int rem = 0;
-	int tasksize;
 	int i;
 	int ret = 0;
 	short min_score_adj = OOM_SCORE_ADJ_MAX + 1;
 	int minfree = 0;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free;
 	int other_file;
+	int nr_scanned = 0;
+	ktime_t start;
 	unsigned long nr_to_scan = sc->nr_to_scan;
 
 	if (nr_to_scan > 0) {
@@ -256,60 +664,32 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 
 		return rem;
 	}
-	selected_oom_score_adj = min_score_adj;
 
+	start = ktime_get();
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			if (test_task_flag(tsk, TIF_MEMDIE)) {
-				rcu_read_unlock();
-				/* give the system time to free up the memory */
-				msleep_interruptible(20);
-				mutex_unlock(&scan_mutex);
-				return 0;
-			}
-		}
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
-			     p->comm, p->pid, oom_score_adj, tasksize);
+	if (lowmem_select(min_score_adj, &victim, &nr_scanned)) {
+		rcu_read_unlock();
+		if (victim.task)
+			put_task_struct(victim.task);
+		/* give the system time to free up the memory */
+		msleep_interruptible(20);
+		mutex_unlock(&scan_mutex);
+		return 0;
 	}
+	selected = victim.task;
+	trace_almk_select(min_score_adj,
+			  selected ? selected->pid : 0,
+			  victim.oom_score_adj, victim.tasksize, nr_scanned,
+			  ktime_to_ns(ktime_sub(ktime_get(), start)));
+
 	if (selected) {
 		lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
 				"   to free %ldkB on behalf of '%s' (%d) because\n" \
 				"   cache %ldkB is below limit %ldkB for oom_score_adj %d\n" \
 				"   Free memory is %ldkB above reserved\n",
 			     selected->comm, selected->pid,
-			     selected_oom_score_adj,
-			     selected_tasksize * (long)(PAGE_SIZE / 1024),
+			     victim.oom_score_adj,
+			     victim.tasksize * (long)(PAGE_SIZE / 1024),
 			     current->comm, current->pid,
 			     other_file * (long)(PAGE_SIZE / 1024),
 			     minfree * (long)(PAGE_SIZE / 1024),
@@ -318,9 +698,11 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
+		lowmem_queue_reap(selected);
+		rem -= victim.tasksize;
 		/* give the system time to free up the memory */
 		msleep_interruptible(20);
+		put_task_struct(selected);
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     nr_to_scan, sc->gfp_mask, rem);
@@ -336,6 +718,11 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_reap_thread = kthread_run(lowmem_reaper, NULL, "lmk_reaper");
+	if (IS_ERR(lowmem_reap_thread)) {
+		pr_err("failed to start the reaper thread\n");
+		lowmem_reap_thread = NULL;
+	}
 	register_shrinker(&lowmem_shrinker);
 	vmpressure_notifier_register(&lmk_vmpr_nb);
 	return 0;
@@ -344,6 +731,8 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	if (lowmem_reap_thread)
+		kthread_stop(lowmem_reap_thread);
 }
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
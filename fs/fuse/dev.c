@@ -209,6 +209,9 @@ void fuse_put_request(struct fuse_conn *fc, struct fuse_req *req)
 		if (req->waiting)
 			atomic_dec(&fc->num_waiting);
 
+		if (req->passthrough_filp)
+			fput(req->passthrough_filp);
+
 		if (req->stolen_file)
 			put_reserved_req(fc, req);
 		else
@@ -228,28 +231,200 @@ static unsigned len_args(unsigned numargs, struct fuse_arg *args)
 	return nbytes;
 }
 
-static u64 fuse_get_unique(struct fuse_conn *fc)
+/*
+ * Each queue hands out ids in steps of FUSE_MAX_IQUEUES from its own
+ * starting point, so ids are unique across the connection
+ *
+ * Called with iq->lock
+ */
+static u64 fuse_get_unique(struct fuse_iqueue *iq)
+{
+	u64 unique = iq->reqctr;
+
+	iq->reqctr += FUSE_MAX_IQUEUES;
+	return unique;
+}
+
+static unsigned fuse_iqueue_index(struct fuse_conn *fc)
+{
+	return raw_smp_processor_id() % fc->nr_iqs;
+}
+
+/* Get a unique id for an interrupt or forget, which aren't queued */
+static u64 fuse_conn_get_unique(struct fuse_conn *fc)
 {
-	fc->reqctr++;
-	/* zero is special */
-	if (fc->reqctr == 0)
-		fc->reqctr = 1;
+	struct fuse_iqueue *iq = &fc->iqs[fuse_iqueue_index(fc)];
+	u64 unique;
+
+	spin_lock(&iq->lock);
+	unique = fuse_get_unique(iq);
+	spin_unlock(&iq->lock);
+
+	return unique;
+}
 
-	return fc->reqctr;
+/*
+ * Wake up a reader.  Readers wait on all the queues, so waking the
+ * queue of this cpu is enough for interrupts and forgets too.
+ */
+static void fuse_iqueue_wake(struct fuse_conn *fc, struct fuse_iqueue *iq)
+{
+	wake_up(&iq->waitq);
+	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
 }
 
-static void queue_request(struct fuse_conn *fc, struct fuse_req *req)
+void fuse_iqueues_wake_all(struct fuse_conn *fc)
+{
+	unsigned i;
+
+	for (i = 0; i < FUSE_MAX_IQUEUES; i++)
+		wake_up_all(&fc->iqs[i].waitq);
+}
+
+static int fuse_iqueues_pending(struct fuse_conn *fc)
+{
+	unsigned i;
+
+	for (i = 0; i < fc->nr_iqs; i++)
+		if (!list_empty(&fc->iqs[i].pending))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Take the oldest request off the input queue of this cpu, or steal
+ * one from the next busy queue if it is empty.  The request is moved
+ * to the io list of its queue and marked as being read.
+ *
+ * May be called with or without fc->lock held.
+ */
+static struct fuse_req *fuse_dequeue_request(struct fuse_conn *fc)
+{
+	unsigned i, first = fuse_iqueue_index(fc);
+	struct fuse_iqueue *iq;
+	struct fuse_req *req;
+
+	for (i = 0; i < fc->nr_iqs; i++) {
+		iq = &fc->iqs[(first + i) % fc->nr_iqs];
+		if (list_empty(&iq->pending))
+			continue;
+
+		spin_lock(&iq->lock);
+		if (iq->connected && !list_empty(&iq->pending)) {
+			req = list_entry(iq->pending.next, struct fuse_req,
+					 list);
+			req->state = FUSE_REQ_READING;
+			list_move(&req->list, &iq->io);
+			spin_unlock(&iq->lock);
+			return req;
+		}
+		spin_unlock(&iq->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Take the request off whichever list it is on
+ *
+ * Called with fc->lock
+ */
+static void request_unlink(struct fuse_req *req)
+{
+	struct fuse_iqueue *iq = req->iq;
+
+	if (iq) {
+		spin_lock(&iq->lock);
+		list_del(&req->list);
+		req->iq = NULL;
+		spin_unlock(&iq->lock);
+	} else {
+		list_del(&req->list);
+	}
+}
+
+/*
+ * Stop requests from being queued on or read off the input queues,
+ * optionally moving the requests currently being read to @io
+ *
+ * Called with fc->lock
+ */
+void fuse_iqueues_disconnect(struct fuse_conn *fc, struct list_head *io)
+{
+	struct fuse_req *req;
+	unsigned i;
+
+	for (i = 0; i < FUSE_MAX_IQUEUES; i++) {
+		struct fuse_iqueue *iq = &fc->iqs[i];
+
+		spin_lock(&iq->lock);
+		iq->connected = 0;
+		if (io) {
+			list_for_each_entry(req, &iq->io, list)
+				req->iq = NULL;
+			list_splice_tail_init(&iq->io, io);
+		}
+		spin_unlock(&iq->lock);
+	}
+}
+
+/*
+ * Move all pending requests off the input queues to @head
+ *
+ * Called with fc->lock
+ */
+static void fuse_iqueues_splice_pending(struct fuse_conn *fc,
+					struct list_head *head)
 {
+	struct fuse_req *req;
+	unsigned i;
+
+	for (i = 0; i < FUSE_MAX_IQUEUES; i++) {
+		struct fuse_iqueue *iq = &fc->iqs[i];
+
+		spin_lock(&iq->lock);
+		list_for_each_entry(req, &iq->pending, list)
+			req->iq = NULL;
+		list_splice_tail_init(&iq->pending, head);
+		spin_unlock(&iq->lock);
+	}
+}
+
+/*
+ * Add a request to the input queue of this cpu and wake up a reader.
+ * Unless @unique is given, the request gets a new unique id.
+ *
+ * Only the queue lock is taken, so this may be called with or without
+ * fc->lock held.  Returns false without queueing the request if the
+ * queue has been disconnected, unless @force is set.  Background
+ * requests are forced: abort and release flush them after
+ * disconnecting, and end them along with the other pending requests.
+ */
+static bool queue_request(struct fuse_conn *fc, struct fuse_req *req,
+			  u64 unique, bool force)
+{
+	struct fuse_iqueue *iq = &fc->iqs[fuse_iqueue_index(fc)];
+
 	req->in.h.len = sizeof(struct fuse_in_header) +
 		len_args(req->in.numargs, (struct fuse_arg *) req->in.args);
-	list_add_tail(&req->list, &fc->pending);
-	req->state = FUSE_REQ_PENDING;
+	spin_lock(&iq->lock);
+	if (!iq->connected && !force) {
+		spin_unlock(&iq->lock);
+		return false;
+	}
 	if (!req->waiting) {
 		req->waiting = 1;
 		atomic_inc(&fc->num_waiting);
 	}
-	wake_up(&fc->waitq);
-	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
+	req->in.h.unique = unique ? unique : fuse_get_unique(iq);
+	list_add_tail(&req->list, &iq->pending);
+	req->iq = iq;
+	req->state = FUSE_REQ_PENDING;
+	spin_unlock(&iq->lock);
+	fuse_iqueue_wake(fc, iq);
+
+	return true;
 }
 
 void fuse_queue_forget(struct fuse_conn *fc, struct fuse_forget_link *forget,
@@ -262,8 +437,7 @@ void fuse_queue_forget(struct fuse_conn *fc, struct fuse_forget_link *forget,
 	if (fc->connected) {
 		fc->forget_list_tail->next = forget;
 		fc->forget_list_tail = forget;
-		wake_up(&fc->waitq);
-		kill_fasync(&fc->fasync, SIGIO, POLL_IN);
+		fuse_iqueue_wake(fc, &fc->iqs[fuse_iqueue_index(fc)]);
 	} else {
 		kfree(forget);
 	}
@@ -279,8 +453,7 @@ static void flush_bg_queue(struct fuse_conn *fc)
 		req = list_entry(fc->bg_queue.next, struct fuse_req, list);
 		list_del(&req->list);
 		fc->active_background++;
-		req->in.h.unique = fuse_get_unique(fc);
-		queue_request(fc, req);
+		queue_request(fc, req, 0, true);
 	}
 }
 
@@ -299,7 +472,7 @@ __releases(fc->lock)
 {
 	void (*end) (struct fuse_conn *, struct fuse_req *) = req->end;
 	req->end = NULL;
-	list_del(&req->list);
+	request_unlink(req);
 	list_del(&req->intr_entry);
 	req->state = FUSE_REQ_FINISHED;
 	if (req->background) {
@@ -325,40 +498,40 @@ __releases(fc->lock)
 
 static void wait_answer_interruptible(struct fuse_conn *fc,
 				      struct fuse_req *req)
-__releases(fc->lock)
-__acquires(fc->lock)
 {
 	if (signal_pending(current))
 		return;
 
-	spin_unlock(&fc->lock);
 	wait_event_interruptible(req->waitq, req->state == FUSE_REQ_FINISHED);
-	spin_lock(&fc->lock);
 }
 
 static void queue_interrupt(struct fuse_conn *fc, struct fuse_req *req)
 {
 	list_add_tail(&req->intr_entry, &fc->interrupts);
-	wake_up(&fc->waitq);
-	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
+	fuse_iqueue_wake(fc, &fc->iqs[fuse_iqueue_index(fc)]);
 }
 
+/*
+ * Called without fc->lock, so that the request is queued and waited
+ * for without touching it until the answer arrives or a signal is
+ * taken
+ */
 static void request_wait_answer(struct fuse_conn *fc, struct fuse_req *req)
-__releases(fc->lock)
-__acquires(fc->lock)
 {
 	if (!fc->no_interrupt) {
 		/* Any signal may interrupt this */
 		wait_answer_interruptible(fc, req);
 
+		spin_lock(&fc->lock);
 		if (req->aborted)
 			goto aborted;
 		if (req->state == FUSE_REQ_FINISHED)
-			return;
+			goto out;
 
 		req->interrupted = 1;
 		if (req->state == FUSE_REQ_SENT)
 			queue_interrupt(fc, req);
+		spin_unlock(&fc->lock);
 	}
 
 	if (!req->force) {
@@ -369,33 +542,46 @@ __acquires(fc->lock)
 		wait_answer_interruptible(fc, req);
 		restore_sigs(&oldset);
 
+		spin_lock(&fc->lock);
 		if (req->aborted)
 			goto aborted;
 		if (req->state == FUSE_REQ_FINISHED)
-			return;
-
-		/* Request is not yet in userspace, bail out */
-		if (req->state == FUSE_REQ_PENDING) {
-			list_del(&req->list);
-			__fuse_put_request(req);
-			req->out.h.error = -EINTR;
-			return;
+			goto out;
+
+		/*
+		 * Request is not yet in userspace, bail out.  Readers take
+		 * requests off the input queue without fc->lock, so recheck
+		 * under the queue lock.  A pending request without a queue
+		 * is being aborted.
+		 */
+		if (req->state == FUSE_REQ_PENDING && req->iq) {
+			struct fuse_iqueue *iq = req->iq;
+
+			spin_lock(&iq->lock);
+			if (req->state == FUSE_REQ_PENDING) {
+				list_del(&req->list);
+				req->iq = NULL;
+				spin_unlock(&iq->lock);
+				__fuse_put_request(req);
+				req->out.h.error = -EINTR;
+				goto out;
+			}
+			spin_unlock(&iq->lock);
 		}
+		spin_unlock(&fc->lock);
 	}
 
 	/*
 	 * Either request is already in userspace, or it was forced.
 	 * Wait it out.
 	 */
-	spin_unlock(&fc->lock);
-
 	while (req->state != FUSE_REQ_FINISHED)
 		wait_event_freezable(req->waitq,
 				     req->state == FUSE_REQ_FINISHED);
 	spin_lock(&fc->lock);
 
 	if (!req->aborted)
-		return;
+		goto out;
 
  aborted:
 	BUG_ON(req->state != FUSE_REQ_FINISHED);
@@ -409,26 +595,28 @@ __acquires(fc->lock)
 		wait_event(req->waitq, !req->locked);
 		spin_lock(&fc->lock);
 	}
+ out:
+	spin_unlock(&fc->lock);
 }
 
 void fuse_request_send(struct fuse_conn *fc, struct fuse_req *req)
 {
 	req->isreply = 1;
-	spin_lock(&fc->lock);
-	if (!fc->connected)
-		req->out.h.error = -ENOTCONN;
-	else if (fc->conn_error)
+	if (fc->conn_error) {
 		req->out.h.error = -ECONNREFUSED;
-	else {
-		req->in.h.unique = fuse_get_unique(fc);
-		queue_request(fc, req);
-		/* acquire extra reference, since request is still needed
-		   after request_end() */
-		__fuse_get_request(req);
+		return;
+	}
 
-		request_wait_answer(fc, req);
+	/* acquire extra reference, since request is still needed
+	   after request_end(), which may run as soon as it's queued */
+	__fuse_get_request(req);
+	if (!queue_request(fc, req, 0, false)) {
+		__fuse_put_request(req);
+		req->out.h.error = -ENOTCONN;
+		return;
 	}
-	spin_unlock(&fc->lock);
+
+	request_wait_answer(fc, req);
 }
 EXPORT_SYMBOL_GPL(fuse_request_send);
 
@@ -473,13 +661,8 @@ static int fuse_request_send_notify_reply(struct fuse_conn *fc,
 	int err = -ENODEV;
 
 	req->isreply = 0;
-	req->in.h.unique = unique;
-	spin_lock(&fc->lock);
-	if (fc->connected) {
-		queue_request(fc, req);
+	if (queue_request(fc, req, unique, false))
 		err = 0;
-	}
-	spin_unlock(&fc->lock);
 
 	return err;
 }
@@ -963,21 +1146,30 @@ static int forget_pending(struct fuse_conn *fc)
 
 static int request_pending(struct fuse_conn *fc)
 {
-	return !list_empty(&fc->pending) || !list_empty(&fc->interrupts) ||
+	return fuse_iqueues_pending(fc) || !list_empty(&fc->interrupts) ||
 		forget_pending(fc);
 }
 
-/* Wait until a request is available on the pending list */
+/*
+ * Wait until a request is available on any of the input queues.
+ * Requests are queued without fc->lock, so the task state has to be
+ * set before looking at the queues.
+ */
 static void request_wait(struct fuse_conn *fc)
 __releases(fc->lock)
 __acquires(fc->lock)
 {
-	DECLARE_WAITQUEUE(wait, current);
+	wait_queue_t wait[FUSE_MAX_IQUEUES];
+	unsigned i;
 
-	add_wait_queue_exclusive(&fc->waitq, &wait);
-	while (fc->connected && !request_pending(fc)) {
+	for (i = 0; i < fc->nr_iqs; i++) {
+		init_waitqueue_entry(&wait[i], current);
+		add_wait_queue_exclusive(&fc->iqs[i].waitq, &wait[i]);
+	}
+	for (;;) {
 		set_current_state(TASK_INTERRUPTIBLE);
-		if (signal_pending(current))
+		if (!fc->connected || request_pending(fc) ||
+		    signal_pending(current))
 			break;
 
 		spin_unlock(&fc->lock);
@@ -985,7 +1177,8 @@ __acquires(fc->lock)
 		spin_lock(&fc->lock);
 	}
 	set_current_state(TASK_RUNNING);
-	remove_wait_queue(&fc->waitq, &wait);
+	for (i = 0; i < fc->nr_iqs; i++)
+		remove_wait_queue(&fc->iqs[i].waitq, &wait[i]);
 }
 
 /*
@@ -1006,7 +1199,7 @@ __releases(fc->lock)
 	int err;
 
 	list_del_init(&req->intr_entry);
-	req->intr_unique = fuse_get_unique(fc);
+	req->intr_unique = fuse_conn_get_unique(fc);
 	memset(&ih, 0, sizeof(ih));
 	memset(&arg, 0, sizeof(arg));
 	ih.len = reqsize;
@@ -1061,7 +1254,7 @@ __releases(fc->lock)
 	struct fuse_in_header ih = {
 		.opcode = FUSE_FORGET,
 		.nodeid = forget->forget_one.nodeid,
-		.unique = fuse_get_unique(fc),
+		.unique = fuse_conn_get_unique(fc),
 		.len = sizeof(ih) + sizeof(arg),
 	};
 
@@ -1092,7 +1285,7 @@ __releases(fc->lock)
 	struct fuse_batch_forget_in arg = { .count = 0 };
 	struct fuse_in_header ih = {
 		.opcode = FUSE_BATCH_FORGET,
-		.unique = fuse_get_unique(fc),
+		.unique = fuse_conn_get_unique(fc),
 		.len = sizeof(ih) + sizeof(arg),
 	};
 
@@ -1148,6 +1341,11 @@ __releases(fc->lock)
  * was an error during the copying then it's finished by calling
  * request_end().  Otherwise add it to the processing list, and set
  * the 'sent' flag.
+ *
+ * Unless interrupts or forgets are waiting, a request is first looked
+ * for on the input queues without taking fc->lock.  fc->lock is still
+ * taken once the request has been copied, since the locked/aborted
+ * handshake with abort and the processing list are guarded by it.
  */
 static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 				struct fuse_copy_state *cs, size_t nbytes)
@@ -1156,8 +1354,15 @@ static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 	struct fuse_req *req;
 	struct fuse_in *in;
 	unsigned reqsize;
+	struct fuse_iqueue *iq;
 
  restart:
+	if (list_empty(&fc->interrupts) && !forget_pending(fc)) {
+		req = fuse_dequeue_request(fc);
+		if (req)
+			goto got_request;
+	}
+
 	spin_lock(&fc->lock);
 	err = -EAGAIN;
 	if ((file->f_flags & O_NONBLOCK) && fc->connected &&
@@ -1179,17 +1384,20 @@ static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 	}
 
 	if (forget_pending(fc)) {
-		if (list_empty(&fc->pending) || fc->forget_batch-- > 0)
+		if (!fuse_iqueues_pending(fc) || fc->forget_batch-- > 0)
 			return fuse_read_forget(fc, cs, nbytes);
 
 		if (fc->forget_batch <= -8)
 			fc->forget_batch = 16;
 	}
 
-	req = list_entry(fc->pending.next, struct fuse_req, list);
-	req->state = FUSE_REQ_READING;
-	list_move(&req->list, &fc->io);
+	req = fuse_dequeue_request(fc);
+	spin_unlock(&fc->lock);
+	/* another reader may have taken it in the meantime */
+	if (!req)
+		goto restart;
 
+ got_request:
 	in = &req->in;
 	reqsize = in->h.len;
 	/* If request is too large, reply with an error and restart the read */
@@ -1198,10 +1406,10 @@ static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 		/* SETXATTR is special, since it may contain too large data */
 		if (in->h.opcode == FUSE_SETXATTR)
 			req->out.h.error = -E2BIG;
+		spin_lock(&fc->lock);
 		request_end(fc, req);
 		goto restart;
 	}
-	spin_unlock(&fc->lock);
 	cs->req = req;
 	err = fuse_copy_one(cs, &in->h, sizeof(in->h));
 	if (!err)
@@ -1223,7 +1431,11 @@ static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
 		request_end(fc, req);
 	else {
 		req->state = FUSE_REQ_SENT;
+		iq = req->iq;
+		spin_lock(&iq->lock);
 		list_move_tail(&req->list, &fc->processing);
+		req->iq = NULL;
+		spin_unlock(&iq->lock);
 		if (req->interrupted)
 			queue_interrupt(fc, req);
 		spin_unlock(&fc->lock);
@@ -1828,6 +2040,10 @@ static ssize_t fuse_dev_do_write(struct fuse_conn *fc,
 	err = copy_out_args(cs, &req->out, nbytes);
 	fuse_copy_finish(cs);
 
+	if (!err && !req->out.h.error && fc->passthrough &&
+	    (req->in.h.opcode == FUSE_OPEN || req->in.h.opcode == FUSE_CREATE))
+		fuse_setup_passthrough(fc, req);
+
 	spin_lock(&fc->lock);
 	req->locked = 0;
 	if (!err) {
@@ -1941,10 +2157,12 @@ static unsigned fuse_dev_poll(struct file *file, poll_table *wait)
 {
 	unsigned mask = POLLOUT | POLLWRNORM;
 	struct fuse_conn *fc = fuse_get_conn(file);
+	unsigned i;
 	if (!fc)
 		return POLLERR;
 
-	poll_wait(file, &fc->waitq, wait);
+	for (i = 0; i < fc->nr_iqs; i++)
+		poll_wait(file, &fc->iqs[i].waitq, wait);
 
 	spin_lock(&fc->lock);
 	if (!fc->connected)
@@ -2015,9 +2233,12 @@ static void end_queued_requests(struct fuse_conn *fc)
 __releases(fc->lock)
 __acquires(fc->lock)
 {
+	LIST_HEAD(pending);
+
 	fc->max_background = UINT_MAX;
 	flush_bg_queue(fc);
-	end_requests(fc, &fc->pending);
+	fuse_iqueues_splice_pending(fc, &pending);
+	end_requests(fc, &pending);
 	end_requests(fc, &fc->processing);
 	while (forget_pending(fc))
 		kfree(dequeue_forget(fc, 1, NULL));
@@ -2052,6 +2273,8 @@ static void end_polls(struct fuse_conn *fc)
  * During the aborting, progression of requests from the pending and
  * processing lists onto the io list, and progression of new requests
  * onto the pending list is prevented by req->connected being false.
+ * Submitters and readers using the input queues without fc->lock are
+ * stopped by the queues' connected flag, which is cleared first.
  *
  * Progression of requests under I/O to the processing list is
  * prevented by the req->aborted flag being true for these requests.
@@ -2063,10 +2286,11 @@ void fuse_abort_conn(struct fuse_conn *fc)
 	if (fc->connected) {
 		fc->connected = 0;
 		fc->blocked = 0;
+		fuse_iqueues_disconnect(fc, &fc->io);
 		end_io_requests(fc);
 		end_queued_requests(fc);
 		end_polls(fc);
-		wake_up_all(&fc->waitq);
+		fuse_iqueues_wake_all(fc);
 		wake_up_all(&fc->blocked_waitq);
 		kill_fasync(&fc->fasync, SIGIO, POLL_IN);
 	}
@@ -2081,6 +2305,7 @@ int fuse_dev_release(struct inode *inode, struct file *file)
 		spin_lock(&fc->lock);
 		fc->connected = 0;
 		fc->blocked = 0;
+		fuse_iqueues_disconnect(fc, NULL);
 		end_queued_requests(fc);
 		end_polls(fc);
 		wake_up_all(&fc->blocked_waitq);
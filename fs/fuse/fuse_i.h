@@ -32,6 +32,9 @@
 /** It could be as large as PATH_MAX, but would that have any uses? */
 #define FUSE_NAME_MAX 1024
 
+/** Magic number of a fuse superblock */
+#define FUSE_SUPER_MAGIC 0x65735546
+
 /** Number of dentries for each connection in the control filesystem */
 #define FUSE_CTL_NUM_DENTRIES 5
 
@@ -139,6 +142,9 @@ struct fuse_file {
 	/** Wait queue head for poll */
 	wait_queue_head_t poll_wait;
 
+	/** Lower file reads, writes and mmaps go to, if any */
+	struct file *passthrough_filp;
+
 	/** Has flock been performed on this file? */
 	bool flock:1;
 };
@@ -214,10 +220,13 @@ enum fuse_req_state {
  * A request to the client
  */
 struct fuse_req {
-	/** This can be on either pending processing or io lists in
-	    fuse_conn */
+	/** This can be on either pending or io lists of an input queue,
+	    or on processing or io lists in fuse_conn */
 	struct list_head list;
 
+	/** The input queue whose list this request is on, if any */
+	struct fuse_iqueue *iq;
+
 	/** Entry on the interrupts list  */
 	struct list_head intr_entry;
 
@@ -321,6 +330,9 @@ struct fuse_req {
 
 	/** Request is stolen from fuse_file->reserved_req */
 	struct file *stolen_file;
+
+	/** Passthrough file picked up from an OPEN or CREATE reply */
+	struct file *passthrough_filp;
 };
 
 /**
@@ -330,6 +342,40 @@ struct fuse_req {
  * destroyed, when the client device is closed and the filesystem is
  * unmounted.
  */
+/** Maximum number of input queues of a connection */
+#define FUSE_MAX_IQUEUES 8
+
+/**
+ * An input queue of a connection.
+ *
+ * Requests are queued on the input queue of the submitting cpu, and
+ * readers of the device take them from the queue of their own cpu,
+ * stealing from the other queues when it is empty.  Submitters only
+ * take the lock of their queue and wake up its waitq, so neither they
+ * nor readers picking up a request contend on fuse_conn->lock.
+ *
+ * The lock nests inside fuse_conn->lock.
+ */
+struct fuse_iqueue {
+	/** Lock protecting the members below */
+	spinlock_t lock;
+
+	/** Cleared when the connection is killed, aborted or released */
+	unsigned connected;
+
+	/** The next unique request id handed out by this queue */
+	u64 reqctr;
+
+	/** Readers of the connection are waiting on this */
+	wait_queue_head_t waitq;
+
+	/** The list of pending requests */
+	struct list_head pending;
+
+	/** The list of requests being read by userspace */
+	struct list_head io;
+} ____cacheline_aligned_in_smp;
+
 struct fuse_conn {
 	/** Lock protecting accessess to  members of this structure */
 	spinlock_t lock;
@@ -355,11 +401,11 @@ struct fuse_conn {
 	/** Maximum write size */
 	unsigned max_write;
 
-	/** Readers of the connection are waiting on this */
-	wait_queue_head_t waitq;
+	/** Input queues of pending requests */
+	struct fuse_iqueue iqs[FUSE_MAX_IQUEUES];
 
-	/** The list of pending requests */
-	struct list_head pending;
+	/** Number of input queues in use */
+	unsigned nr_iqs;
 
 	/** The list of requests being processed */
 	struct list_head processing;
@@ -409,9 +455,6 @@ struct fuse_conn {
 	/** waitq for reserved requests */
 	wait_queue_head_t reserved_req_waitq;
 
-	/** The next unique request id */
-	u64 reqctr;
-
 	/** Connection established, cleared on umount, connection
 	    abort and device release */
 	unsigned connected;
@@ -489,6 +532,9 @@ struct fuse_conn {
 	/** Are BSD file locking primitives not implemented by fs? */
 	unsigned no_flock:1;
 
+	/** May open replies hand over a passthrough file? */
+	unsigned passthrough:1;
+
 	/** The number of requests waiting for completion */
 	atomic_t num_waiting;
 
@@ -701,6 +747,12 @@ void fuse_request_send_background_locked(struct fuse_conn *fc,
 /* Abort all requests */
 void fuse_abort_conn(struct fuse_conn *fc);
 
+/* Stop requests from being queued or read off the input queues */
+void fuse_iqueues_disconnect(struct fuse_conn *fc, struct list_head *io);
+
+/* Wake up all readers of the device */
+void fuse_iqueues_wake_all(struct fuse_conn *fc);
+
 /**
  * Invalidate inode attributes
  */
@@ -789,4 +841,14 @@ int fuse_dev_release(struct inode *inode, struct file *file);
 
 void fuse_write_update_size(struct inode *inode, loff_t pos);
 
+/* passthrough.c */
+void fuse_setup_passthrough(struct fuse_conn *fc, struct fuse_req *req);
+ssize_t fuse_passthrough_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos);
+ssize_t fuse_passthrough_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos);
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma);
+void fuse_passthrough_check_mode(struct fuse_file *ff, struct file *file);
+void fuse_passthrough_release(struct fuse_file *ff);
+
 #endif /* _FS_FUSE_I_H */
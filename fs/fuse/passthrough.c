@@ -0,0 +1,193 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "fuse_i.h"
+
+#include <linux/aio.h>
+#include <linux/file.h>
+#include <linux/fsnotify.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+
+/*
+ * Passthrough lets the daemon answer OPEN and CREATE with a file
+ * descriptor of a file on another filesystem.  Reads, writes and mmaps
+ * of the fuse file are then done directly on that file, skipping the
+ * round trip through the daemon, while everything else (lookups,
+ * permissions, attributes) still goes to the daemon.
+ */
+
+/*
+ * Pick up the file the daemon handed us in an OPEN or CREATE reply.
+ * This runs in the context of the daemon writing the reply, so that the
+ * descriptor is looked up in its file table.
+ */
+void fuse_setup_passthrough(struct fuse_conn *fc, struct fuse_req *req)
+{
+	struct fuse_open_out *open_out;
+	struct file *passthrough_filp;
+	struct inode *passthrough_inode;
+
+	open_out = req->out.args[req->out.numargs - 1].value;
+	if (!(open_out->open_flags & FOPEN_PASSTHROUGH))
+		return;
+
+	passthrough_filp = fget(open_out->passthrough_fd);
+	if (!passthrough_filp) {
+		printk(KERN_WARNING "fuse: invalid passthrough fd %u\n",
+		       open_out->passthrough_fd);
+		return;
+	}
+
+	/* no stacking fuse on fuse, and the lower file must do the I/O */
+	passthrough_inode = passthrough_filp->f_dentry->d_inode;
+	if (!S_ISREG(passthrough_inode->i_mode) ||
+	    passthrough_inode->i_sb->s_magic == FUSE_SUPER_MAGIC ||
+	    !passthrough_filp->f_op || !passthrough_filp->f_op->aio_read) {
+		printk(KERN_WARNING "fuse: unsupported passthrough file\n");
+		fput(passthrough_filp);
+		return;
+	}
+
+	req->passthrough_filp = passthrough_filp;
+}
+
+static ssize_t fuse_passthrough_rw(struct kiocb *iocb,
+				   const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos,
+				   int write)
+{
+	struct file *file = iocb->ki_filp;
+	struct fuse_file *ff = file->private_data;
+	struct file *passthrough_filp = ff->passthrough_filp;
+	size_t count = iov_length(iov, nr_segs);
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	if (write) {
+		if (!(passthrough_filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (!passthrough_filp->f_op->aio_write)
+			return -EINVAL;
+		/*
+		 * Appending is left to the lower file, which finds the end
+		 * under its own i_mutex; the flags were matched at open, so
+		 * this only catches O_APPEND being set with fcntl() since.
+		 */
+		if ((file->f_flags & O_APPEND) &&
+		    !(passthrough_filp->f_flags & O_APPEND))
+			return -EINVAL;
+	} else {
+		if (!(passthrough_filp->f_mode & FMODE_READ))
+			return -EBADF;
+	}
+
+	/* the same checks vfs_read() and vfs_write() do on the lower file */
+	ret = rw_verify_area(write ? WRITE : READ, passthrough_filp, &pos,
+			     count);
+	if (ret < 0)
+		return ret;
+
+	init_sync_kiocb(&kiocb, passthrough_filp);
+	kiocb.ki_pos = pos;
+	kiocb.ki_left = count;
+	kiocb.ki_nbytes = count;
+
+	if (write)
+		ret = passthrough_filp->f_op->aio_write(&kiocb, iov, nr_segs,
+							pos);
+	else
+		ret = passthrough_filp->f_op->aio_read(&kiocb, iov, nr_segs,
+						       pos);
+	if (ret == -EIOCBQUEUED)
+		ret = wait_on_sync_kiocb(&kiocb);
+	iocb->ki_pos = kiocb.ki_pos;
+
+	if (ret > 0 && write) {
+		struct inode *inode = file->f_dentry->d_inode;
+
+		fsnotify_modify(passthrough_filp);
+		fuse_write_update_size(inode, kiocb.ki_pos);
+		fuse_invalidate_attr(inode);
+	} else if (ret > 0) {
+		fsnotify_access(passthrough_filp);
+	}
+
+	return ret;
+}
+
+ssize_t fuse_passthrough_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos)
+{
+	return fuse_passthrough_rw(iocb, iov, nr_segs, pos, 0);
+}
+
+ssize_t fuse_passthrough_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos)
+{
+	return fuse_passthrough_rw(iocb, iov, nr_segs, pos, 1);
+}
+
+/*
+ * Map the lower file instead.  The vma takes a reference on it and
+ * drops the one mmap_region() took on the fuse file.
+ */
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fuse_file *ff = file->private_data;
+	struct file *passthrough_filp = ff->passthrough_filp;
+	int ret;
+
+	if (!passthrough_filp->f_op->mmap)
+		return -ENODEV;
+
+	/* do_mmap_pgoff() only checked the fuse file's mode */
+	if ((vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_MAYWRITE) &&
+	    !(passthrough_filp->f_mode & FMODE_WRITE))
+		return -EACCES;
+
+	ret = passthrough_filp->f_op->mmap(passthrough_filp, vma);
+	if (ret)
+		return ret;
+
+	get_file(passthrough_filp);
+	vma->vm_file = passthrough_filp;
+	fput(file);
+
+	return 0;
+}
+
+/*
+ * The daemon may only hand over a file that was opened for at least
+ * everything the fuse file was opened for; otherwise it could be used to
+ * read or write the lower file behind the back of its permissions.  An
+ * appending fuse file also needs an appending lower file, as only that
+ * can find the end of the file atomically.  If the file doesn't fit,
+ * fall back to doing the I/O through the daemon.
+ */
+void fuse_passthrough_check_mode(struct fuse_file *ff, struct file *file)
+{
+	fmode_t mode = file->f_mode & (FMODE_READ | FMODE_WRITE);
+	struct file *passthrough_filp = ff->passthrough_filp;
+
+	if ((passthrough_filp->f_mode & mode) != mode) {
+		printk(KERN_WARNING "fuse: passthrough file mode too narrow\n");
+		fuse_passthrough_release(ff);
+	} else if ((file->f_flags & O_APPEND) &&
+		   !(passthrough_filp->f_flags & O_APPEND)) {
+		printk(KERN_WARNING "fuse: passthrough file not appending\n");
+		fuse_passthrough_release(ff);
+	}
+}
+
+void fuse_passthrough_release(struct fuse_file *ff)
+{
+	if (ff->passthrough_filp) {
+		fput(ff->passthrough_filp);
+		ff->passthrough_filp = NULL;
+	}
+}
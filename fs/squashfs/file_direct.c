@@ -0,0 +1,192 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * file_direct.c
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+
+#ifdef CONFIG_HIGHMEM
+/*
+ * All the pages of a block are kmap()ed at once, up to 256 of them for a
+ * 1MB block.  Unbounded, concurrent readers could share out the whole
+ * pkmap pool between them and then all sleep in kmap() waiting for each
+ * other.  So readers first reserve their pages out of at most half the
+ * pool, all or nothing, which leaves the rest for everybody else.
+ */
+#define SQUASHFS_KMAP_MAX	(LAST_PKMAP / 2)
+
+static DEFINE_SPINLOCK(squashfs_kmap_lock);
+static DECLARE_WAIT_QUEUE_HEAD(squashfs_kmap_wait);
+static int squashfs_kmap_avail = SQUASHFS_KMAP_MAX;
+
+static bool squashfs_kmap_try_reserve(int pages)
+{
+	bool ret;
+
+	spin_lock(&squashfs_kmap_lock);
+	ret = squashfs_kmap_avail >= pages;
+	if (ret)
+		squashfs_kmap_avail -= pages;
+	spin_unlock(&squashfs_kmap_lock);
+
+	return ret;
+}
+
+static int squashfs_kmap_reserve(int pages)
+{
+	pages = min(pages, SQUASHFS_KMAP_MAX);
+	wait_event(squashfs_kmap_wait, squashfs_kmap_try_reserve(pages));
+	return pages;
+}
+
+static void squashfs_kmap_unreserve(int pages)
+{
+	spin_lock(&squashfs_kmap_lock);
+	squashfs_kmap_avail += pages;
+	spin_unlock(&squashfs_kmap_lock);
+	wake_up_all(&squashfs_kmap_wait);
+}
+#else
+static inline int squashfs_kmap_reserve(int pages)
+{
+	return pages;
+}
+
+static inline void squashfs_kmap_unreserve(int pages)
+{
+}
+#endif
+
+/*
+ * Read separately compressed datablock directly into the page cache.
+ *
+ * All the pages the block covers are grabbed and handed to the
+ * decompressor as its output buffers, saving the intermediate cache
+ * entry and the copy out of it.  Pages which cannot be grabbed without
+ * blocking, or which are already up to date, are given a scratch page
+ * instead, whose contents are thrown away.
+ */
+int squashfs_readpage_block(struct page *target_page, u64 block, int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_end = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = min(start_index | mask, file_end);
+	int pages = end_index - start_index + 1;
+	int i, n, avail, reserved, res = -ENOMEM;
+	struct page **page, *scratch = NULL;
+	void **pageaddr;
+
+	page = kcalloc(pages, sizeof(*page), GFP_KERNEL);
+	pageaddr = kcalloc(pages, sizeof(*pageaddr), GFP_KERNEL);
+	if (page == NULL || pageaddr == NULL)
+		goto out;
+
+	/* before taking any more page locks, see squashfs_kmap_avail */
+	reserved = squashfs_kmap_reserve(pages);
+
+	for (i = 0, n = start_index; n <= end_index; i++, n++) {
+		if (n == target_page->index) {
+			page[i] = target_page;
+			continue;
+		}
+
+		page[i] = grab_cache_page_nowait(target_page->mapping, n);
+		if (page[i] && PageUptodate(page[i])) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+			page[i] = NULL;
+		}
+
+		if (page[i] == NULL && scratch == NULL) {
+			scratch = alloc_page(GFP_KERNEL);
+			if (scratch == NULL)
+				goto unreserve;
+		}
+	}
+
+	for (i = 0; i < pages; i++)
+		pageaddr[i] = kmap(page[i] ? page[i] : scratch);
+
+	res = squashfs_read_data(inode->i_sb, pageaddr, block, bsize, NULL,
+		min_t(int, msblk->block_size, pages << PAGE_CACHE_SHIFT), pages);
+
+	/* zero the part of the pages past the end of the block */
+	for (i = 0; res >= 0 && i < pages; i++) {
+		avail = clamp_t(int, res - (i << PAGE_CACHE_SHIFT), 0,
+			PAGE_CACHE_SIZE);
+		if (page[i] && avail < PAGE_CACHE_SIZE)
+			memset(pageaddr[i] + avail, 0, PAGE_CACHE_SIZE - avail);
+	}
+
+	for (i = 0; i < pages; i++)
+		kunmap(page[i] ? page[i] : scratch);
+	squashfs_kmap_unreserve(reserved);
+
+	if (res < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		goto release_pages;
+	}
+	res = 0;
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL)
+			continue;
+		flush_dcache_page(page[i]);
+		SetPageUptodate(page[i]);
+		unlock_page(page[i]);
+		if (page[i] != target_page)
+			page_cache_release(page[i]);
+	}
+	goto out;
+
+unreserve:
+	squashfs_kmap_unreserve(reserved);
+release_pages:
+	/* the caller deals with the target page on failure */
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL || page[i] == target_page)
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+
+out:
+	if (scratch)
+		__free_page(scratch);
+	kfree(pageaddr);
+	kfree(page);
+	return res;
+}
@@ -105,6 +105,7 @@ enum pmem_allocator_type {
 
 	PMEM_ALLOCATORTYPE_ALLORNOTHING,
 	PMEM_ALLOCATORTYPE_BUDDYBESTFIT,
+	PMEM_ALLOCATORTYPE_EXTENT,
 
 	PMEM_ALLOCATORTYPE_MAX,
 };
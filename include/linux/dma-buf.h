@@ -65,6 +65,12 @@ struct dma_buf_attachment;
  * 	  mapping needs to be coherent - if the exporter doesn't directly
  * 	  support this, it needs to fake coherency by shooting down any ptes
  * 	  when transitioning away from the cpu domain.
+ * @cache_sgt_mapping: [optional] if set, the core keeps the sg_table returned
+ *		       by map_dma_buf on the attachment and hands it out again
+ *		       on later maps in the same direction, only calling
+ *		       unmap_dma_buf on detach or after the exporter called
+ *		       dma_buf_invalidate_mappings() because the backing
+ *		       storage moved.
  */
 struct dma_buf_ops {
 	int (*attach)(struct dma_buf *, struct device *,
@@ -98,6 +104,8 @@ struct dma_buf_ops {
 	void (*kunmap)(struct dma_buf *, unsigned long, void *);
 
 	int (*mmap)(struct dma_buf *, struct vm_area_struct *vma);
+
+	bool cache_sgt_mapping;
 };
 
 /**
@@ -124,6 +132,11 @@ struct dma_buf {
  * @dev: device attached to the buffer.
  * @node: list of dma_buf_attachment.
  * @priv: exporter specific attachment data.
+ * @sgt: cached mapping, if the exporter set cache_sgt_mapping.
+ * @dir: direction @sgt was mapped for.
+ * @map_count: number of users currently holding @sgt.
+ * @sgt_stale: @sgt must not be handed out again and is unmapped as soon as
+ *	       @map_count drops to zero.
  *
  * This structure holds the attachment information between the dma_buf buffer
  * and its user device(s). The list contains one attachment struct per device
@@ -134,6 +147,10 @@ struct dma_buf_attachment {
 	struct device *dev;
 	struct list_head node;
 	void *priv;
+	struct sg_table *sgt;
+	enum dma_data_direction dir;
+	unsigned int map_count;
+	bool sgt_stale;
 };
 
 /**
@@ -165,6 +182,7 @@ struct sg_table *dma_buf_map_attachment(struct dma_buf_attachment *,
 					enum dma_data_direction);
 void dma_buf_unmap_attachment(struct dma_buf_attachment *, struct sg_table *,
 				enum dma_data_direction);
+void dma_buf_invalidate_mappings(struct dma_buf *dmabuf);
 int dma_buf_begin_cpu_access(struct dma_buf *dma_buf, size_t start, size_t len,
 			     enum dma_data_direction dir);
 void dma_buf_end_cpu_access(struct dma_buf *dma_buf, size_t start, size_t len,
@@ -224,6 +242,10 @@ static inline void dma_buf_unmap_attachment(struct dma_buf_attachment *attach,
 	return;
 }
 
+static inline void dma_buf_invalidate_mappings(struct dma_buf *dmabuf)
+{
+}
+
 static inline int dma_buf_begin_cpu_access(struct dma_buf *dmabuf,
 					   size_t start, size_t len,
 					   enum dma_data_direction dir)
@@ -19,6 +19,13 @@
 # define INIT_PUSHABLE_TASKS(tsk)
 #endif
 
+#ifdef CONFIG_ANDROID_LMK_ADJ_INDEX
+# define INIT_ADJ_NODE(tsk)						\
+	.adj_node	= LIST_HEAD_INIT(tsk.adj_node),
+#else
+# define INIT_ADJ_NODE(tsk)
+#endif
+
 extern struct files_struct init_files;
 extern struct fs_struct init_fs;
 
@@ -170,6 +177,7 @@ extern struct task_group root_task_group;
 	},								\
 	.tasks		= LIST_HEAD_INIT(tsk.tasks),			\
 	INIT_PUSHABLE_TASKS(tsk)					\
+	INIT_ADJ_NODE(tsk)						\
 	INIT_CGROUP_SCHED(tsk)						\
 	.ptraced	= LIST_HEAD_INIT(tsk.ptraced),			\
 	.ptrace_entry	= LIST_HEAD_INIT(tsk.ptrace_entry),		\
@@ -43,6 +43,45 @@ enum oom_constraint {
 extern void compare_swap_oom_score_adj(int old_val, int new_val);
 extern int test_set_oom_score_adj(int new_val);
 
+#ifdef CONFIG_ANDROID_LMK_ADJ_INDEX
+/*
+ * Thread group leaders bucketed by their oom_score_adj, so that the low
+ * memory killer can find its candidates without walking every process.
+ */
+#define OOM_ADJ_INDEX_BUCKETS	(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+
+extern struct list_head oom_adj_index[OOM_ADJ_INDEX_BUCKETS];
+extern spinlock_t oom_adj_index_lock;
+
+static inline struct list_head *oom_adj_index_bucket(int oom_score_adj)
+{
+	return &oom_adj_index[oom_score_adj - OOM_SCORE_ADJ_MIN];
+}
+
+extern void oom_adj_index_add(struct task_struct *p);
+extern void oom_adj_index_del(struct task_struct *p);
+extern void oom_adj_index_update(struct task_struct *p);
+extern void oom_adj_index_replace(struct task_struct *old,
+				  struct task_struct *new);
+#else
+static inline void oom_adj_index_add(struct task_struct *p)
+{
+}
+
+static inline void oom_adj_index_del(struct task_struct *p)
+{
+}
+
+static inline void oom_adj_index_update(struct task_struct *p)
+{
+}
+
+static inline void oom_adj_index_replace(struct task_struct *old,
+					 struct task_struct *new)
+{
+}
+#endif
+
 extern unsigned int oom_badness(struct task_struct *p, struct mem_cgroup *memcg,
 			const nodemask_t *nodemask, unsigned long totalpages);
 extern int try_set_zonelist_oom(struct zonelist *zonelist, gfp_t gfp_flags);
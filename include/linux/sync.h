@@ -97,7 +97,8 @@ struct sync_timeline_ops {
  * @child_list_lock:	lock protecting @child_list_head, destroyed, and
  *			  sync_pt.status
  * @active_list_head:	list of active (unsignaled/errored) sync_pts
- * @sync_timeline_list:	membership in global sync_timeline_list
+ * @sync_timeline_list:	membership in global sync_timeline_list, only
+ *			  kept with CONFIG_SYNC_DEBUG
  */
 struct sync_timeline {
 	struct kref		kref;
@@ -113,7 +114,9 @@ struct sync_timeline {
 	struct list_head	active_list_head;
 	spinlock_t		active_list_lock;
 
+#ifdef CONFIG_SYNC_DEBUG
 	struct list_head	sync_timeline_list;
+#endif
 };
 
 /**
@@ -149,14 +152,16 @@ struct sync_pt {
  * @file:		file representing this fence
  * @kref:		referenace count on fence.
  * @name:		name of sync_fence.  Useful for debugging
- * @pt_list_head:	list of sync_pts in ths fence.  immutable once fence
- *			  is created
+ * @pt_list_head:	list of sync_pts in ths fence, at most one per
+ *			  timeline and sorted by timeline.  immutable once
+ *			  fence is created
  * @waiter_list_head:	list of asynchronous waiters on this fence
  * @waiter_list_lock:	lock protecting @waiter_list_head and @status
  * @status:		1: signaled, 0:active, <0: error
  *
  * @wq:			wait queue for fence signaling
- * @sync_fence_list:	membership in global fence list
+ * @sync_fence_list:	membership in global fence list, only kept with
+ *			  CONFIG_SYNC_DEBUG
  */
 struct sync_fence {
 	struct file		*file;
@@ -172,7 +177,9 @@ struct sync_fence {
 
 	wait_queue_head_t	wq;
 
+#ifdef CONFIG_SYNC_DEBUG
 	struct list_head	sync_fence_list;
+#endif
 };
 
 struct sync_fence_waiter;
@@ -15,6 +15,7 @@
 #define _ZS_MALLOC_H_
 
 #include <linux/types.h>
+#include <linux/atomic.h>
 
 /*
  * zsmalloc mapping modes
@@ -27,18 +28,26 @@ enum zs_mapmode {
 	ZS_MM_WO /* write-only (no copy-in at map time) */
 };
 
+struct zs_pool_stats {
+	/* How many pages were migrated (freed) */
+	atomic_long_t pages_compacted;
+};
+
 struct zs_pool;
 
-struct zs_pool *zs_create_pool(gfp_t flags);
+struct zs_pool *zs_create_pool(void);
 void zs_destroy_pool(struct zs_pool *pool);
 
-unsigned long zs_malloc(struct zs_pool *pool, size_t size);
-void zs_free(struct zs_pool *pool, unsigned long obj);
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t gfp);
+void zs_free(struct zs_pool *pool, unsigned long handle);
 
 void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 			enum zs_mapmode mm);
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
 
 unsigned long zs_get_total_pages(struct zs_pool *pool);
+unsigned long zs_compact(struct zs_pool *pool);
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
 
 #endif
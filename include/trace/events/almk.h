@@ -78,6 +78,74 @@ TRACE_EVENT(almk_shrink,
 		__entry->adj)
 );
 
+TRACE_EVENT(almk_select,
+
+	TP_PROTO(short min_adj,
+		 pid_t pid,
+		 short adj,
+		 int tsize,
+		 int nr_scanned,
+		 u64 latency_ns),
+
+	TP_ARGS(min_adj, pid, adj, tsize, nr_scanned, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(short, min_adj)
+		__field(pid_t, pid)
+		__field(short, adj)
+		__field(int, tsize)
+		__field(int, nr_scanned)
+		__field(u64, latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->min_adj	= min_adj;
+		__entry->pid		= pid;
+		__entry->adj		= adj;
+		__entry->tsize		= tsize;
+		__entry->nr_scanned	= nr_scanned;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("min_adj=%d pid=%d adj=%d tsize=%d scanned=%d latency=%lluns",
+		__entry->min_adj,
+		__entry->pid,
+		__entry->adj,
+		__entry->tsize,
+		__entry->nr_scanned,
+		__entry->latency_ns)
+);
+
+TRACE_EVENT(almk_reap,
+
+	TP_PROTO(pid_t pid,
+		 unsigned long nr_pages,
+		 int attempts,
+		 u64 latency_us),
+
+	TP_ARGS(pid, nr_pages, attempts, latency_us),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned long, nr_pages)
+		__field(int, attempts)
+		__field(u64, latency_us)
+	),
+
+	TP_fast_assign(
+		__entry->pid		= pid;
+		__entry->nr_pages	= nr_pages;
+		__entry->attempts	= attempts;
+		__entry->latency_us	= latency_us;
+	),
+
+	TP_printk("pid=%d pages=%lu attempts=%d latency=%lluus",
+		__entry->pid,
+		__entry->nr_pages,
+		__entry->attempts,
+		__entry->latency_us)
+);
+
 #endif
 
 #include <trace/define_trace.h>
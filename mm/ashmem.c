@@ -27,6 +27,8 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 #include <asm/cacheflush.h>
@@ -38,7 +40,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -49,12 +51,14 @@ struct ashmem_area {
 	unsigned long vm_start;		/* Start address of vm_area
 					 * which maps this ashmem */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects this area and its ranges */
+	atomic_t purging;		/* ranges the shrinker is purging */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex', and `lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -65,18 +69,26 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and the count of pages on it
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ * The shrinker only ever trylocks an area's mutex under ashmem_lru_lock, and
+ * purges pages (taking i_mutex -> i_alloc_sem) with neither held.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* Woken when the shrinker finishes purging the ranges of an area */
+static DECLARE_WAIT_QUEUE_HEAD(ashmem_purge_wait);
+
+/* Number of ranges the shrinker takes off the LRU list at a time */
+#define ASHMEM_SHRINK_BATCH	16
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -105,12 +117,14 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
+/* Caller must hold ashmem_lru_lock. */
 static inline void lru_add(struct ashmem_range *range)
 {
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
 }
 
+/* Caller must hold ashmem_lru_lock. */
 static inline void lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
@@ -126,7 +140,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -145,24 +159,31 @@ static int range_alloc(struct ashmem_area *asma,
 
 	list_add_tail(&range->unpinned, &prev_range->unpinned);
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_add(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 
 	return 0;
 }
 
+/* Caller must hold range->asma->mutex. */
 static void range_del(struct ashmem_range *range)
 {
 	list_del(&range->unpinned);
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 	kmem_cache_free(ashmem_range_cachep, range);
 }
 
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold range->asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -172,8 +193,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -190,6 +214,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
+	atomic_set(&asma->purging, 0);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -202,10 +228,13 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
+
+	/* the shrinker may still be purging ranges it took off the LRU */
+	wait_event(ashmem_purge_wait, !atomic_read(&asma->purging));
 
 	if (asma->file)
 		fput(asma->file);
@@ -220,7 +249,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -232,7 +261,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 		goto out_unlock;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	/*
 	 * asma and asma->file are used outside the lock here.  We assume
@@ -248,7 +277,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	return ret;
 
 out_unlock:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -257,7 +286,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -278,7 +307,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -295,7 +324,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -339,10 +368,21 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * ashmem_purge - a range taken off the LRU list by the shrinker, whose pages
+ * are yet to be dropped
+ */
+struct ashmem_purge {
+	struct ashmem_area *asma;	/* area the range belonged to */
+	struct file *file;		/* reference on the backing file */
+	loff_t start;			/* first byte to drop */
+	loff_t end;			/* last byte to drop */
+};
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -355,38 +395,66 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise until we hit 'nr_to_scan' pages freed.
+ * Ranges are taken off the LRU list in batches under ashmem_lru_lock, and
+ * their pages are dropped with no ashmem lock held. Ranges whose area is
+ * locked are left alone, which also keeps us from recursing into ourselves.
+ * Until their pages are gone, asma->purging keeps the area from being pinned
+ * or freed.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
+	struct ashmem_purge batch[ASHMEM_SHRINK_BATCH];
 	struct ashmem_range *range, *next;
+	long nr_to_scan = sc->nr_to_scan;
+	int nr, i;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
-	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
+	if (nr_to_scan && !(sc->gfp_mask & __GFP_FS))
 		return -1;
-	if (!sc->nr_to_scan)
+	if (!nr_to_scan)
 		return lru_count;
 
-/* If our mutex is held, we are recursing into ourselves, so bail out */
-	if (!mutex_trylock(&ashmem_mutex)) {
-		return -1;
-	}
+	while (nr_to_scan > 0) {
+		nr = 0;
 
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+		spin_lock(&ashmem_lru_lock);
+		list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
+			struct ashmem_area *asma = range->asma;
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+			if (!mutex_trylock(&asma->mutex))
+				continue;
+
+			batch[nr].asma = asma;
+			batch[nr].file = asma->file;
+			batch[nr].start = range->pgstart * PAGE_SIZE;
+			batch[nr].end = (range->pgend + 1) * PAGE_SIZE - 1;
+			get_file(asma->file);
+			atomic_inc(&asma->purging);
+
+			range->purged = ASHMEM_WAS_PURGED;
+			lru_del(range);
+			/* the range may be freed as soon as we let go */
+			nr_to_scan -= range_size(range);
+			mutex_unlock(&asma->mutex);
+
+			if (++nr == ASHMEM_SHRINK_BATCH || nr_to_scan <= 0)
+				break;
+		}
+		spin_unlock(&ashmem_lru_lock);
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
+		if (!nr)
 			break;
+
+		for (i = 0; i < nr; i++) {
+			struct inode *inode = batch[i].file->f_dentry->d_inode;
+
+			vmtruncate_range(inode, batch[i].start, batch[i].end);
+			fput(batch[i].file);
+			if (atomic_dec_and_test(&batch[i].asma->purging))
+				wake_up_all(&ashmem_purge_wait);
+		}
 	}
-	mutex_unlock(&ashmem_mutex);
 
 	return lru_count;
 }
@@ -400,7 +468,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -415,7 +483,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -430,7 +498,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 		return len;
 	if (len == ASHMEM_NAME_LEN)
 		lname[ASHMEM_NAME_LEN - 1] = '\0';
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file))
@@ -438,7 +506,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	else
 		strcpy(asma->name + ASHMEM_NAME_PREFIX_LEN, lname);
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -448,7 +516,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 	char lname[ASHMEM_NAME_LEN];
 	size_t len;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		/*
 		 * Copying only `len', instead of ASHMEM_NAME_LEN, bytes
@@ -460,7 +528,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 		len = strlen(ASHMEM_NAME_DEF) + 1;
 		memcpy(lname, ASHMEM_NAME_DEF, len);
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	if (unlikely(copy_to_user(name, lname, len)))
 		ret = -EFAULT;
 	return ret;
@@ -470,7 +538,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -536,7 +604,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -571,7 +639,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -620,7 +688,17 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+
+	/*
+	 * Pages the shrinker has already reported as purged must really be
+	 * gone before the user starts refilling them.
+	 */
+	while (cmd == ASHMEM_PIN && atomic_read(&asma->purging)) {
+		mutex_unlock(&asma->mutex);
+		wait_event(ashmem_purge_wait, !atomic_read(&asma->purging));
+		mutex_lock(&asma->mutex);
+	}
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -634,47 +712,106 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
 
 #ifdef CONFIG_OUTER_CACHE
-static unsigned int virtaddr_to_physaddr(unsigned int virtaddr)
+/*
+ * ashmem_cache_run - pages which are contiguous both virtually and
+ * physically, and so take a single range operation
+ */
+struct ashmem_cache_run {
+	unsigned long vstart;		/* first virtual address */
+	unsigned long pstart;		/* first physical address */
+	unsigned long length;		/* length in bytes, 0 if empty */
+};
+
+/*
+ * Extend `run' by the page at `vaddr', or start a new run with it. Returns
+ * true if that completed the previous run, which is handed back in `done'.
+ */
+static bool ashmem_cache_run_add(struct ashmem_cache_run *run,
+	struct ashmem_cache_run *done, unsigned long vaddr,
+	unsigned long paddr)
 {
-	unsigned int physaddr = 0;
-	pgd_t *pgd_ptr = NULL;
-	pmd_t *pmd_ptr = NULL;
-	pte_t *pte_ptr = NULL, pte;
-
-	spin_lock(&current->mm->page_table_lock);
-	pgd_ptr = pgd_offset(current->mm, virtaddr);
-	if (pgd_none(*pgd) || pgd_bad(*pgd)) {
-		pr_err("Failed to convert virtaddr %x to pgd_ptr\n",
-			virtaddr);
-		goto done;
+	if (run->length && run->vstart + run->length == vaddr &&
+	    run->pstart + run->length == paddr) {
+		run->length += PAGE_SIZE;
+		return false;
 	}
 
-	pmd_ptr = pmd_offset(pgd_ptr, virtaddr);
-	if (pmd_none(*pmd_ptr) || pmd_bad(*pmd_ptr)) {
-		pr_err("Failed to convert pgd_ptr %p to pmd_ptr\n",
-			(void *)pgd_ptr);
-		goto done;
-	}
+	*done = *run;
+	run->vstart = vaddr;
+	run->pstart = paddr;
+	run->length = PAGE_SIZE;
+	return done->length != 0;
+}
 
-	pte_ptr = pte_offset_map(pmd_ptr, virtaddr);
-	if (!pte_ptr) {
-		pr_err("Failed to convert pmd_ptr %p to pte_ptr\n",
-			(void *)pmd_ptr);
-		goto done;
+/*
+ * ashmem_cache_walk - apply `cache_func' to the pages mapped in
+ * [start, end) of `mm', walking each page table once and merging
+ * physically contiguous pages into a single call. Pages which are not
+ * present cannot be in the caches and are skipped.
+ *
+ * The cache operations work on the user addresses and may fault, e.g. on
+ * a pte the hardware has not loaded yet, so they are only issued with the
+ * page table lock dropped.
+ *
+ * Caller must hold mm->mmap_sem.
+ */
+static void ashmem_cache_walk(struct mm_struct *mm,
+	unsigned long start, unsigned long end,
+	void (*cache_func)(unsigned long vstart, unsigned long length,
+				unsigned long pstart))
+{
+	struct ashmem_cache_run run = { .length = 0 };
+	struct ashmem_cache_run done = { .length = 0 };
+	unsigned long addr = start;
+	unsigned long next;
+
+	while (addr < end) {
+		pgd_t *pgd;
+		pud_t *pud;
+		pmd_t *pmd;
+		pte_t *pte, *ptep;
+		spinlock_t *ptl;
+
+		next = pmd_addr_end(addr, end);
+
+		pgd = pgd_offset(mm, addr);
+		if (pgd_none(*pgd) || pgd_bad(*pgd))
+			goto skip;
+		pud = pud_offset(pgd, addr);
+		if (pud_none(*pud) || pud_bad(*pud))
+			goto skip;
+		pmd = pmd_offset(pud, addr);
+		if (pmd_none(*pmd) || pmd_bad(*pmd))
+			goto skip;
+
+		ptep = pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+		for (; addr < next; addr += PAGE_SIZE, pte++) {
+			if (pte_present(*pte) &&
+			    ashmem_cache_run_add(&run, &done, addr,
+					pte_pfn(*pte) << PAGE_SHIFT)) {
+				addr += PAGE_SIZE;
+				break;
+			}
+		}
+		pte_unmap_unlock(ptep, ptl);
+
+		if (done.length) {
+			cache_func(done.vstart, done.length, done.pstart);
+			done.length = 0;
+		}
+		continue;
+skip:
+		addr = next;
 	}
-	pte = *pte_ptr;
-	physaddr = pte_pfn(pte);
-	pte_unmap(pte_ptr);
-done:
-	spin_unlock(&current->mm->page_table_lock);
-	physaddr <<= PAGE_SHIFT;
-	return physaddr;
+
+	if (run.length)
+		cache_func(run.vstart, run.length, run.pstart);
 }
 #endif
 
@@ -684,43 +821,48 @@ static int ashmem_cache_op(struct ashmem_area *asma,
 {
 	int ret = 0;
 	struct vm_area_struct *vma;
-
-#ifdef CONFIG_OUTER_CACHE
-	unsigned long vaddr;
-#endif
-	if (!asma->vm_start)
+	unsigned long vm_start;
+	struct file *file;
+	size_t size;
+
+	/* mmap_sem nests outside of asma->mutex, so take a snapshot */
+	mutex_lock(&asma->mutex);
+	vm_start = asma->vm_start;
+	file = asma->file;
+	size = asma->size;
+	mutex_unlock(&asma->mutex);
+
+	if (!vm_start)
 		return -EINVAL;
 
 	down_read(&current->mm->mmap_sem);
-	vma = find_vma(current->mm, asma->vm_start);
+	vma = find_vma(current->mm, vm_start);
 	if (!vma) {
 		ret = -EINVAL;
 		goto done;
 	}
-	if (vma->vm_file != asma->file) {
+	if (vma->vm_file != file) {
 		ret = -EINVAL;
 		goto done;
 	}
-	if ((asma->vm_start + asma->size) > (vma->vm_start + vma->vm_end)) {
+	if ((vm_start + size) > vma->vm_end) {
 		ret = -EINVAL;
 		goto done;
 	}
 #ifndef CONFIG_OUTER_CACHE
-	cache_func(asma->vm_start, asma->size, 0);
+	cache_func(vm_start, size, 0);
 #else
-	for (vaddr = asma->vm_start; vaddr < asma->vm_start + asma->size;
-		vaddr += PAGE_SIZE) {
-		unsigned long physaddr;
-		physaddr = virtaddr_to_physaddr(vaddr);
-		if (!physaddr)
-			return -EINVAL;
-		cache_func(vaddr, PAGE_SIZE, physaddr);
-	}
+	ashmem_cache_walk(current->mm, vm_start, PAGE_ALIGN(vm_start + size),
+			  cache_func);
 #endif
 done:
 	up_read(&current->mm->mmap_sem);
-	if (ret)
-		asma->vm_start = 0;
+	if (ret) {
+		mutex_lock(&asma->mutex);
+		if (asma->vm_start == vm_start)
+			asma->vm_start = 0;
+		mutex_unlock(&asma->mutex);
+	}
 	return ret;
 }
 
@@ -738,10 +880,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
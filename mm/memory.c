@@ -3514,11 +3514,8 @@ unlock:
 	return 0;
 }
 
-/*
- * By the time we get here, we already hold the mm semaphore
- */
-int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
-		unsigned long address, unsigned int flags)
+static int __handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
+			     unsigned long address, unsigned int flags)
 {
 	pgd_t *pgd;
 	pud_t *pud;
@@ -3593,6 +3590,33 @@ retry:
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+/*
+ * By the time we get here, we already hold the mm semaphore
+ */
+int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, unsigned int flags)
+{
+	bool reapable = !(vma->vm_flags & (VM_SHARED | VM_HUGETLB));
+	int ret;
+
+	ret = __handle_mm_fault(mm, vma, address, flags);
+
+	/*
+	 * The private memory of a killed task may have been torn down by
+	 * the lowmemorykiller, in which case the fault may just have put
+	 * zeroes where the data used to be. The task is dying anyway, so
+	 * fail the fault: a kernel access such as the copy_from_user() of
+	 * an in-flight write() then gets -EFAULT instead of passing the
+	 * zeroes on. The flag is set before the memory is zapped, and the
+	 * page table lock orders any fault that raced with the zap after it.
+	 */
+	if (unlikely(test_bit(MMF_OOM_REAPED, &mm->flags)) && reapable &&
+	    !(ret & (VM_FAULT_ERROR | VM_FAULT_RETRY)))
+		ret = VM_FAULT_SIGBUS;
+
+	return ret;
+}
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
@@ -58,8 +58,10 @@ void compare_swap_oom_score_adj(int old_val, int new_val)
 	struct sighand_struct *sighand = current->sighand;
 
 	spin_lock_irq(&sighand->siglock);
-	if (current->signal->oom_score_adj == old_val)
+	if (current->signal->oom_score_adj == old_val) {
 		current->signal->oom_score_adj = new_val;
+		oom_adj_index_update(current);
+	}
 	trace_oom_score_adj_update(current);
 	spin_unlock_irq(&sighand->siglock);
 }
@@ -80,12 +82,88 @@ int test_set_oom_score_adj(int new_val)
 	spin_lock_irq(&sighand->siglock);
 	old_val = current->signal->oom_score_adj;
 	current->signal->oom_score_adj = new_val;
+	oom_adj_index_update(current);
 	trace_oom_score_adj_update(current);
 	spin_unlock_irq(&sighand->siglock);
 
 	return old_val;
 }
 
+#ifdef CONFIG_ANDROID_LMK_ADJ_INDEX
+/*
+ * The index only holds thread group leaders; the nodes of other threads
+ * stay empty. oom_adj_index_lock nests inside tasklist_lock and siglock,
+ * so it must be taken with interrupts disabled.
+ */
+struct list_head oom_adj_index[OOM_ADJ_INDEX_BUCKETS];
+DEFINE_SPINLOCK(oom_adj_index_lock);
+
+static int __init oom_adj_index_init(void)
+{
+	int i;
+
+	for (i = 0; i < OOM_ADJ_INDEX_BUCKETS; i++)
+		INIT_LIST_HEAD(&oom_adj_index[i]);
+
+	return 0;
+}
+core_initcall(oom_adj_index_init);
+
+static struct list_head *task_adj_bucket(struct task_struct *p)
+{
+	int adj = p->signal->oom_score_adj;
+
+	adj = clamp(adj, OOM_SCORE_ADJ_MIN, OOM_SCORE_ADJ_MAX);
+	return oom_adj_index_bucket(adj);
+}
+
+/* Called with tasklist_lock held for writing when @p is attached */
+void oom_adj_index_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	if (p->flags & PF_KTHREAD)
+		return;
+
+	spin_lock_irqsave(&oom_adj_index_lock, flags);
+	list_add_tail(&p->adj_node, task_adj_bucket(p));
+	spin_unlock_irqrestore(&oom_adj_index_lock, flags);
+}
+
+/* Called with tasklist_lock held for writing when @p's group is gone */
+void oom_adj_index_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&oom_adj_index_lock, flags);
+	list_del_init(&p->adj_node);
+	spin_unlock_irqrestore(&oom_adj_index_lock, flags);
+}
+
+/* Called with @p's siglock held after its oom_score_adj changed */
+void oom_adj_index_update(struct task_struct *p)
+{
+	struct task_struct *leader = p->group_leader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&oom_adj_index_lock, flags);
+	if (!list_empty(&leader->adj_node))
+		list_move_tail(&leader->adj_node, task_adj_bucket(leader));
+	spin_unlock_irqrestore(&oom_adj_index_lock, flags);
+}
+
+/* Called by de_thread() when @new takes over as group leader from @old */
+void oom_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&oom_adj_index_lock, flags);
+	if (!list_empty(&old->adj_node))
+		list_replace_init(&old->adj_node, &new->adj_node);
+	spin_unlock_irqrestore(&oom_adj_index_lock, flags);
+}
+#endif
+
 #ifdef CONFIG_NUMA
 /**
  * has_intersects_mems_allowed() - check task eligiblity for kill